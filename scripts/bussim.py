@@ -0,0 +1,674 @@
+#!/usr/bin/env python
+# Multi-node CAN bus simulator built on the can2040 PIO simulator
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, optparse, random, ctypes
+import piosim
+
+def report(msg):
+    sys.stderr.write(msg + "\n")
+
+
+######################################################################
+# Simulated nodes
+######################################################################
+
+CAN2040_NOTIFY_TX = 1<<21
+CAN2040_NOTIFY_ERROR = 1<<23
+
+# Rx dma channel registers (offsets as found in the rp2040 datasheet)
+DMA_CHAN = 0
+DMA_REG_TRANSFER_COUNT = DMA_CHAN * 0x40 + 0x08
+DMA_REG_CTRL_TRIG = DMA_CHAN * 0x40 + 0x0c
+DMA_REG_AL1_CTRL = DMA_CHAN * 0x40 + 0x10
+DMA_REG_AL1_TRANSFER_COUNT_TRIG = DMA_CHAN * 0x40 + 0x1c
+DMA_REG_ABORT = 0x444
+DMA_CTRL_EN = 1 << 0
+DMA_CTRL_BUSY = 1 << 24
+
+# Bus arbitration, queueing, and irq latency statistics for a node
+class NodeStats:
+    def __init__(self):
+        self.tx_total = self.tx_attempt = self.arb_lost = 0
+        self.rx_total = self.parse_error = self.notify_error = 0
+        self.lost_ack = self.tx_delayed = self.tx_duplicate = 0
+        self.irq_count = self.rx_words = self.bus_bits = 0
+        self.queue_delays = []
+        # Timestamp errors (in seconds) of each notification
+        self.sof_errors = []
+        self.eof_errors = []
+        self.urgent_delays = []
+
+# A message waiting for transmission
+class QueuedMsg:
+    def __init__(self, enqueue_time, can_id, data):
+        self.enqueue_time = enqueue_time
+        self.can_id = can_id
+        self.data = data
+        self.bits = piosim.encode_frame(can_id, data)
+        self.urgent = False
+
+# Create a message with a unique payload (the first byte is the index
+# of the sending node)
+def make_msg(node, enqueue_time, can_id):
+    seq = node.msg_seq
+    node.msg_seq += 1
+    data = [node.index, seq & 0xff, seq >> 8] + [node.index] * 5
+    return QueuedMsg(enqueue_time, can_id, data)
+
+# Return the message id from the unstuffed bits of a message
+def frame_id(bits):
+    can_id = piosim.bits_to_int(bits[1:12])
+    if bits[13]:
+        can_id = (can_id << 18) | piosim.bits_to_int(bits[14:32])
+    return can_id
+
+# Return the data bytes from the unstuffed bits of a message
+def frame_data(bits):
+    pos = 39 if bits[13] else 19
+    return [piosim.bits_to_int(bits[i:i+8]) for i in range(pos, len(bits), 8)]
+
+# A node running can2040 - the PIO is simulated and the ARM core code is
+# the can2040.c host build (see piosim.HostSim).  Calls to the irq
+# handler are delayed by the configured irq latency.
+class Can2040Node(piosim.SimNode):
+    def __init__(self, bus, index, options, skew_ppm, latency,
+                 listen_only=False):
+        name = "listen" if listen_only else "can2040"
+        piosim.SimNode.__init__(self, "%s-%d" % (name, index),
+                                options.sys_clock, options.bitrate, skew_ppm)
+        self.bus = bus
+        self.index = index
+        self.latency = latency
+        self.listen_only = listen_only
+        self.stats = NodeStats()
+        self.msg_seq = 0
+        # Messages not yet accepted by can2040_transmit()
+        self.backlog = []
+        # Messages accepted by can2040_transmit() (awaiting NOTIFY_TX)
+        self.pending = []
+        self.irq_time = None
+        self.got_recessive = bus.offsets['tx_got_recessive']
+        self.rx_cb = piosim.can2040_rx_cb(self.handle_notify)
+        self.call('can2040_callback_config', self.rx_cb)
+        self.call('can2040_listen_only_config', listen_only)
+        if listen_only:
+            # Larger rx fifo entries are only valid in listen-only mode
+            self.call('can2040_rx_wake_config', options.wake_bits)
+        self.call('can2040_tx_priority_config', options.tx_priority)
+        self.timestamps = options.timestamps
+        self.call('can2040_timestamp_config', options.timestamps)
+        if options.tx_queue:
+            self.tx_queue = ctypes.create_string_buffer(
+                options.tx_queue * self.hs.lib.hostsim_sizeof_transmit())
+            self.call('can2040_tx_queue_config', self.tx_queue,
+                      options.tx_queue)
+        # Optional dma copy of rx fifo entries into a ram ring
+        self.dma_size = options.dma_ring
+        self.dma_irq = False
+        if self.dma_size:
+            # Ring must be aligned to its size
+            self.dma_buf = (ctypes.c_uint32 * (self.dma_size * 2))()
+            addr = ctypes.addressof(self.dma_buf)
+            addr += -addr % (self.dma_size * 4)
+            self.dma_ring = (ctypes.c_uint32 * self.dma_size).from_address(
+                addr)
+            self.dma_ctrl = self.dma_count = self.dma_pos = 0
+            self.call('can2040_rx_dma_config', DMA_CHAN, self.dma_ring,
+                      self.dma_size)
+        self.start()
+    # Callbacks from can2040.c
+    def handle_notify(self, cd, notify, msg):
+        if notify & CAN2040_NOTIFY_ERROR:
+            self.stats.notify_error += 1
+            return
+        m = msg.contents
+        if self.timestamps:
+            self.check_timestamps(msg)
+        if not notify & CAN2040_NOTIFY_TX:
+            return
+        key = (m.id, list(m.data))
+        for qm in self.pending:
+            if (qm.can_id, qm.data) == key:
+                break
+        else:
+            report("%s: unknown tx notification" % (self.name,))
+            return
+        self.pending.remove(qm)
+        delays = self.stats.queue_delays
+        if qm.urgent:
+            delays = self.stats.urgent_delays
+        delays.append(self.next_time - qm.enqueue_time)
+    # Compare message timestamps to the bus monitor times
+    def check_timestamps(self, msg):
+        m = ctypes.cast(msg, ctypes.POINTER(piosim.can2040_msg_ts)).contents
+        times = self.bus.frame_times.get((m.msg.id, tuple(m.msg.data)))
+        if times is None:
+            return
+        # Convert the (32bit microsecond) rp2040 timer to seconds
+        for ts, t, errors in [(m.sof_time, times[0], self.stats.sof_errors),
+                              (m.eof_time, times[1], self.stats.eof_errors)]:
+            diff = (ts - int(t * 1000000.)) & piosim.MASK32
+            if diff & 0x80000000:
+                diff -= 1 << 32
+            errors.append(diff / 1000000.)
+    # Add a message to the transmit queue
+    def transmit(self, qm):
+        self.backlog.append(qm)
+        self.feed_transmits()
+    def feed_transmits(self):
+        while self.backlog and self.call('can2040_check_transmit'):
+            qm = self.backlog[0]
+            msg = piosim.can2040_msg(qm.can_id, len(qm.data),
+                                     (ctypes.c_uint8 * 8)(*qm.data))
+            if self.call('can2040_transmit', ctypes.byref(msg)) < 0:
+                break
+            self.backlog.pop(0)
+            self.pending.append(qm)
+    def has_pending(self):
+        return self.backlog or self.pending
+    def update_stats(self):
+        cs = piosim.can2040_stats()
+        self.call('can2040_get_statistics', ctypes.byref(cs))
+        st = self.stats
+        st.tx_total, st.tx_attempt = cs.tx_total, cs.tx_attempt
+        st.rx_total, st.parse_error = cs.rx_total, cs.parse_error
+        st.bus_bits = cs.bus_bits
+    # Is the PIO "tx" state machine loaded with a message to transmit
+    def tx_armed(self):
+        pio = self.pio
+        return (pio.enabled & 0x08 and pio.sm[3].tx_fifo
+                and pio.instr_mem[self.got_recessive] == 0x6021) # out x, 1
+    # Register accesses made by can2040.c
+    def io_read(self, dev, offset):
+        if dev == piosim.HS_DMA and self.dma_size:
+            val = self.dma_read(offset)
+            if val is not None:
+                return val
+        if dev == piosim.HS_PIO0 and offset == piosim.REG_RXF0 + 4:
+            self.stats.rx_words += 1
+        return piosim.SimNode.io_read(self, dev, offset)
+    def io_write(self, dev, offset, val):
+        if dev == piosim.HS_DMA and self.dma_size:
+            return self.dma_write(offset, val)
+        return piosim.SimNode.io_write(self, dev, offset, val)
+    # Dma channel copying PIO "rx" fifo entries into the rx ring
+    def dma_transfer(self):
+        if not self.dma_ctrl & DMA_CTRL_EN:
+            return
+        pio = self.pio
+        while pio.sm[1].rx_fifo and self.dma_count:
+            self.dma_ring[self.dma_pos % self.dma_size] = pio.read_rxf(1)
+            self.dma_pos += 1
+            self.dma_count -= 1
+            self.stats.rx_words += 1
+            # The fifo "not empty" irq is still latched by the ARM core
+            self.dma_irq = True
+    def dma_read(self, offset):
+        self.dma_transfer()
+        if offset == DMA_REG_TRANSFER_COUNT:
+            return self.dma_count
+        if offset in (DMA_REG_CTRL_TRIG, DMA_REG_AL1_CTRL):
+            if self.dma_ctrl & DMA_CTRL_EN and self.dma_count:
+                return self.dma_ctrl | DMA_CTRL_BUSY
+            return self.dma_ctrl
+        if offset == DMA_REG_ABORT:
+            return 0
+        return None
+    def dma_write(self, offset, val):
+        if offset == DMA_REG_TRANSFER_COUNT:
+            self.dma_count = val
+        elif offset == DMA_REG_CTRL_TRIG:
+            self.dma_ctrl = val
+            self.dma_pos = 0
+        elif offset == DMA_REG_AL1_CTRL:
+            self.dma_ctrl = val
+        elif offset == DMA_REG_AL1_TRANSFER_COUNT_TRIG:
+            self.dma_count = val
+        elif offset == DMA_REG_ABORT:
+            self.dma_ctrl &= ~DMA_CTRL_EN
+        else:
+            return 0
+        return 1
+    def tick(self, line):
+        t = self.next_time
+        pio = self.pio
+        self.sync.append(line)
+        level = self.sync.pop(0)
+        pio.step(piosim.MASK32 & ~((1 - level) << self.gpio_rx))
+        self.next_time += self.tick_time
+        if self.dma_size:
+            self.dma_transfer()
+        # ARM core irq delivery (delayed by the configured irq latency)
+        if self.irq_time is None:
+            if pio.read_ints0() or self.dma_irq:
+                self.irq_time = t + self.latency(self)
+        elif t >= self.irq_time:
+            self.irq_time = None
+            self.dma_irq = False
+            for i in range(16):
+                self.stats.irq_count += 1
+                self.call('can2040_pio_irq_handler')
+                if not pio.read_ints0():
+                    break
+            self.feed_transmits()
+
+# A scripted non-can2040 node (an ideal CAN bus controller)
+class ForeignNode:
+    TQ_PER_BIT = 16
+    SAMPLE_TQ = 11
+    def __init__(self, bus, index, options, skew_ppm):
+        self.bus = bus
+        self.index = index
+        self.name = "foreign-%d" % (index,)
+        self.bit_time = 1. / options.bitrate * (1. - skew_ppm * 1e-6)
+        self.tick_time = self.bit_time / self.TQ_PER_BIT
+        self.next_time = 0.
+        self.tq = 0
+        self.out = self.prev_line = 1
+        self.idle_bits = 11
+        self.queue = []
+        self.tx_pos = None
+        self.stats = NodeStats()
+        self.msg_seq = 0
+    def transmit(self, qm):
+        self.queue.append(qm)
+    def has_pending(self):
+        return self.queue
+    def update_stats(self):
+        pass
+    def level(self, t):
+        return self.out
+    def start_transmit(self):
+        self.tx_pos = 0
+        self.stats.tx_attempt += 1
+    def tick(self, line):
+        t = self.next_time
+        self.next_time += self.tick_time
+        if self.prev_line and not line and self.out:
+            # Resynchronize on recessive to dominant edge
+            if self.tx_pos is None and self.queue and self.idle_bits >= 10:
+                # Another node started a message - join line arbitration
+                self.start_transmit()
+            self.tq = 0
+        self.prev_line = line
+        if not self.tq:
+            # Start of bit - update output
+            if (self.tx_pos is None and self.queue
+                and self.idle_bits >= 11):
+                self.start_transmit()
+            if self.tx_pos is not None:
+                bits = self.queue[0].bits
+                self.out = bits[self.tx_pos] if self.tx_pos < len(bits) else 1
+        elif self.tq == self.SAMPLE_TQ:
+            if line:
+                self.idle_bits += 1
+            else:
+                self.idle_bits = 0
+            if self.tx_pos is not None:
+                msg = self.queue[0]
+                if self.tx_pos >= len(msg.bits):
+                    # Sampled ack slot
+                    self.tx_pos = None
+                    if not line:
+                        self.queue.pop(0)
+                        self.stats.tx_total += 1
+                        self.stats.queue_delays.append(t - msg.enqueue_time)
+                elif self.out and not line:
+                    # Lost line arbitration
+                    self.stats.arb_lost += 1
+                    self.tx_pos = None
+                    self.out = 1
+                else:
+                    self.tx_pos += 1
+        self.tq = (self.tq + 1) % self.TQ_PER_BIT
+
+# Decodes the frames on the bus (sampling like an ideal CAN controller)
+# and checks that receiving nodes ack each frame
+class BusMonitor:
+    TQ_PER_BIT = 16
+    SAMPLE_TQ = 11
+    def __init__(self, bus, bit_time):
+        self.bus = bus
+        self.tick_time = bit_time / self.TQ_PER_BIT
+        self.next_time = 0.
+        self.tq = 0
+        self.prev_line = 1
+        self.idle_bits = 0
+        self.raw = None
+        self.frame = self.frame_bits = None
+        self.sof_time = None
+        self.contenders = []
+        # Bits from a sof to 11 recessive bits after the last dominant bit
+        self.sample_count = self.busy_bits = 0
+        self.busy_start = self.last_dominant = None
+    def level(self, t):
+        return 1
+    def note_sof(self):
+        self.contenders = []
+        for n in self.bus.members:
+            if not isinstance(n, Can2040Node):
+                continue
+            if n.tx_armed():
+                self.contenders.append(n)
+            elif [m for m in n.backlog + n.pending
+                  if (m.can_id, m.data) not in self.bus.delivered]:
+                # Node missed line arbitration for this message
+                n.stats.tx_delayed += 1
+    def note_error(self):
+        self.raw = self.frame = None
+        self.idle_bits = 0
+    def note_crc_end(self, t):
+        # Ideal controllers always ack the message
+        sender = frame_data(self.frame_bits)[0]
+        if [n for n in self.bus.members
+            if isinstance(n, ForeignNode) and n.index != sender]:
+            ack_time = t + (self.TQ_PER_BIT - self.SAMPLE_TQ) * self.tick_time
+            self.bus.acks.append((ack_time, ack_time + self.bus.bit_time))
+    def note_ack(self, t, line):
+        bits = self.frame_bits
+        can_id, data = frame_id(bits), frame_data(bits)
+        sender = self.bus.members[data[0]]
+        for n in self.contenders:
+            if n is not sender:
+                n.stats.arb_lost += 1
+        # Check that can2040 receivers drive the ack bit
+        for n in self.bus.members:
+            if (isinstance(n, Can2040Node) and n is not sender
+                and not n.listen_only and n.tx_level()):
+                n.stats.lost_ack += 1
+        if not line:
+            key = (can_id, data)
+            if key in self.bus.delivered:
+                sender.stats.tx_duplicate += 1
+            self.bus.delivered.append(key)
+            self.bus.frames.append((t, sender, can_id))
+            # Start of sof bit and end of last eof bit
+            eof_time = self.sof_time + (len(self.raw) + 8) * self.bus.bit_time
+            self.bus.frame_times[(can_id, tuple(data))] = (self.sof_time, eof_time)
+        # Without an ack the line may have been passive since the crc (a
+        # transmitter may retry after 10 passive bits)
+        raw = self.raw
+        self.idle_bits = raw[::-1].index(0) if line else 0
+        self.raw = self.frame = None
+    def note_busy(self, line):
+        pos = self.sample_count
+        self.sample_count += 1
+        if self.busy_start is None:
+            if not line and self.raw is None and self.idle_bits >= 10:
+                # Start of frame
+                self.busy_start = self.last_dominant = pos
+        elif not line:
+            self.last_dominant = pos
+        elif pos - self.last_dominant >= 11:
+            self.busy_bits += pos + 1 - self.busy_start
+            self.busy_start = None
+    def sample(self, t, line):
+        self.note_busy(line)
+        if self.raw is None:
+            # Wait for start of frame
+            if line:
+                self.idle_bits += 1
+            elif self.idle_bits >= 10:
+                self.raw = [line]
+                self.sof_time = t - self.SAMPLE_TQ * self.tick_time
+                self.note_sof()
+            else:
+                self.idle_bits = 0
+            return
+        raw = self.raw
+        raw.append(line)
+        if self.frame is None:
+            try:
+                bits = piosim.unstuff_frame(raw)
+            except ValueError:
+                self.note_error()
+                return
+            if bits is not None:
+                self.frame_bits = bits
+                self.frame = piosim.stuff_frame(bits)
+            return
+        if len(raw) == len(self.frame):
+            if raw != self.frame:
+                self.note_error()
+                return
+            self.note_crc_end(t)
+        elif len(raw) > len(self.frame):
+            self.note_ack(t, line)
+    def tick(self, line):
+        t = self.next_time
+        self.next_time += self.tick_time
+        if self.prev_line and not line:
+            # Resynchronize on recessive to dominant edge
+            self.tq = 0
+        self.prev_line = line
+        if self.tq == self.SAMPLE_TQ:
+            self.sample(t, line)
+        self.tq = (self.tq + 1) % self.TQ_PER_BIT
+
+
+######################################################################
+# Bus simulation
+######################################################################
+
+class SimBus(piosim.Bus):
+    def __init__(self, bit_time):
+        piosim.Bus.__init__(self, [])
+        self.bit_time = bit_time
+        self.offsets = piosim.load_program()[1]
+        self.acks = []
+        self.members = []
+        self.delivered = []
+        self.frames = []
+        self.frame_times = {}
+        self.nodes.append(BusMonitor(self, bit_time))
+    def add_member(self, node):
+        self.members.append(node)
+        self.nodes.append(node)
+    def level(self, t):
+        while self.acks and self.acks[0][1] <= t:
+            self.acks.pop(0)
+        if self.acks and self.acks[0][0] <= t:
+            # Foreign receivers are driving a dominant ack bit
+            return 0
+        return piosim.Bus.level(self, t)
+    def pending(self):
+        for n in self.members:
+            if n.has_pending():
+                return True
+        return False
+    def get_gaps(self):
+        # Return number of idle bits prior to each start-of-frame
+        gaps = []
+        prev_rise = None
+        for t, lvl in self.history:
+            if lvl:
+                prev_rise = t
+            elif prev_rise is not None:
+                idle = (t - prev_rise) / self.bit_time
+                if idle >= 10.:
+                    gaps.append(idle)
+        return gaps
+
+
+######################################################################
+# Startup
+######################################################################
+
+def parse_list(val, count, default):
+    vals = [float(v) for v in val.split(',')] if val else []
+    while len(vals) < count:
+        vals.append(default(len(vals)))
+    return vals
+
+# Run a simulation until all messages sent (or time limit reached)
+def run_sim(options, ids, skews, latency):
+    bit_time = 1. / options.bitrate
+    count = options.nodes + options.foreign
+    bus = SimBus(bit_time)
+    for i in range(count):
+        if i < options.nodes:
+            node = Can2040Node(bus, i, options, skews[i], latency)
+        else:
+            node = ForeignNode(bus, i, options, skews[i])
+        bus.add_member(node)
+        for j in range(options.messages):
+            node.transmit(make_msg(node, 0., ids[i]))
+    for i in range(count, count + options.listen):
+        bus.add_member(Can2040Node(bus, i, options, 0., latency, True))
+    end_time = 0.
+    max_time = options.time_limit * bit_time
+    urgent_time = None
+    if options.urgent:
+        urgent_id, interval = [int(v, 0) for v in options.urgent.split(':')]
+        urgent_time = 0.
+    while bus.pending() and end_time < max_time:
+        end_time += 100 * bit_time
+        bus.run_until(end_time)
+        if urgent_time is not None and end_time >= urgent_time + (
+                interval * bit_time):
+            # Periodic high priority message on the first node
+            urgent_time = end_time
+            node = bus.members[0]
+            msg = make_msg(node, end_time, urgent_id)
+            msg.urgent = True
+            node.transmit(msg)
+    bus.run_until(end_time + 50 * bit_time)
+    for n in bus.members:
+        n.update_stats()
+    return bus
+
+# Build the irq latency function for the can2040 nodes
+def make_latency(options, max_bits, rand):
+    bit_time = 1. / options.bitrate
+    if options.random_latency:
+        return lambda n: rand.uniform(0., max_bits) * bit_time
+    return lambda n: max_bits * bit_time
+
+def sum_stats(bus, name):
+    return sum([getattr(n.stats, name) for n in bus.members
+                if isinstance(n, Can2040Node)])
+
+def run_sweep(options, ids, skews):
+    bit_time = 1. / options.bitrate
+    rand = random.Random(options.seed)
+    report("latency  lost_ack  tx_delayed  notify_error  tx_duplicate"
+           "  tx_total  bit_times  irqs")
+    for lat in [float(v) for v in options.sweep.split(',')]:
+        bus = run_sim(options, ids, skews, make_latency(options, lat, rand))
+        report("%7.1f  %8d  %10d  %12d  %12d  %8d  %9.0f  %4d"
+               % (lat, sum_stats(bus, 'lost_ack'),
+                  sum_stats(bus, 'tx_delayed'),
+                  sum_stats(bus, 'notify_error'),
+                  sum_stats(bus, 'tx_duplicate'),
+                  sum_stats(bus, 'tx_total'), bus.time / bit_time,
+                  sum_stats(bus, 'irq_count')))
+
+def main():
+    usage = "%prog [options]"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-b", "--bitrate", type="int", dest="bitrate",
+                    default=1000000, help="CAN bus bitrate")
+    opts.add_option("-c", "--sys-clock", type="int", dest="sys_clock",
+                    default=125000000, help="rp2040 system clock")
+    opts.add_option("-n", "--nodes", type="int", dest="nodes", default=3,
+                    help="number of can2040 nodes")
+    opts.add_option("-f", "--foreign", type="int", dest="foreign",
+                    default=0, help="number of scripted non-can2040 nodes")
+    opts.add_option("-o", "--listen", type="int", dest="listen", default=0,
+                    help="number of listen-only can2040 nodes")
+    opts.add_option("-m", "--messages", type="int", dest="messages",
+                    default=5, help="messages queued on each node")
+    opts.add_option("-i", "--ids", type="string", dest="ids",
+                    help="comma separated message ids for each node"
+                    " (default 0x100 + node index)")
+    opts.add_option("-s", "--skew", type="string", dest="skew",
+                    help="comma separated clock skew (in ppm) for each node")
+    opts.add_option("-l", "--latency", type="float", dest="latency",
+                    default=0., help="can2040 irq latency (in bit times)")
+    opts.add_option("-r", "--random-latency", action="store_true",
+                    dest="random_latency",
+                    help="use a random irq latency between 0 and --latency")
+    opts.add_option("--seed", type="int", dest="seed", default=0,
+                    help="random number seed for --random-latency")
+    opts.add_option("--sweep", type="string", dest="sweep",
+                    help="comma separated irq latencies to report on")
+    opts.add_option("-t", "--time-limit", type="int", dest="time_limit",
+                    default=20000, help="simulation limit (in bit times)")
+    opts.add_option("-w", "--wake-bits", type="int", dest="wake_bits",
+                    default=10, help="bits per rx fifo entry (10, 20, or 30)")
+    opts.add_option("-d", "--dma-ring", type="int", dest="dma_ring",
+                    default=0, help="rx dma ring size (0 to read rx fifo)")
+    opts.add_option("-q", "--tx-queue", type="int", dest="tx_queue",
+                    default=0, help="can2040 transmit queue size"
+                    " (0 for the can2040 default)")
+    opts.add_option("-p", "--tx-priority", action="store_true",
+                    dest="tx_priority",
+                    help="transmit queued messages lowest id first")
+    opts.add_option("-u", "--urgent", type="string", dest="urgent",
+                    help="queue message ID on the first node every INTERVAL"
+                    " bit times (ID:INTERVAL)")
+    opts.add_option("-T", "--timestamps", action="store_true",
+                    dest="timestamps",
+                    help="check can2040 message timestamps")
+    options, args = opts.parse_args()
+    if args:
+        opts.error("Incorrect number of arguments")
+    for size in [options.dma_ring, options.tx_queue]:
+        if size & (size - 1):
+            opts.error("Queue sizes must be a power of two")
+    options.tx_priority = not not options.tx_priority
+    options.timestamps = not not options.timestamps
+    bit_time = 1. / options.bitrate
+    count = options.nodes + options.foreign
+    ids = [int(v, 0) for v in options.ids.split(',')] if options.ids else []
+    while len(ids) < count:
+        ids.append(0x100 + len(ids))
+    skews = parse_list(options.skew, count, lambda i: 0.)
+    if options.sweep:
+        run_sweep(options, ids, skews)
+        return
+    rand = random.Random(options.seed)
+    bus = run_sim(options, ids, skews,
+                  make_latency(options, options.latency, rand))
+    # Report results
+    report("Simulated %.0f bit times (%d messages)"
+           % (bus.time / bit_time, len(bus.frames)))
+    order = ' '.join(["%x" % (can_id,) for t, n, can_id in bus.frames])
+    report("Message order: %s" % (order,))
+    for i, node in enumerate(bus.members):
+        st = node.stats
+        delays = [d / bit_time for d in st.queue_delays]
+        avg = sum(delays) / len(delays) if delays else 0.
+        if i < count:
+            report("%s: id=0x%x skew=%.0fppm tx_total=%d tx_attempt=%d"
+                   " arb_lost=%d queue_delay(avg/max)=%.0f/%.0f bits"
+                   % (node.name, ids[i], skews[i], st.tx_total,
+                      st.tx_attempt, st.arb_lost, avg, max(delays or [0.])))
+        else:
+            report("%s: listen-only" % (node.name,))
+        if isinstance(node, Can2040Node):
+            report("  rx_total=%d parse_error=%d lost_ack=%d tx_delayed=%d"
+                   " notify_error=%d tx_duplicate=%d"
+                   % (st.rx_total, st.parse_error, st.lost_ack,
+                      st.tx_delayed, st.notify_error, st.tx_duplicate))
+            report("  irq_count=%d rx_words=%d bus_bits=%d"
+                   % (st.irq_count, st.rx_words, st.bus_bits))
+            if st.sof_errors:
+                errs = ["%.2f/%.2f" % (min(e) / bit_time, max(e) / bit_time)
+                        for e in [st.sof_errors, st.eof_errors]]
+                report("  timestamp error(min/max) sof=%s eof=%s bits"
+                       % tuple(errs))
+            if st.urgent_delays:
+                delays = [d / bit_time for d in st.urgent_delays]
+                report("  urgent_total=%d urgent_delay(avg/max)=%.0f/%.0f bits"
+                       % (len(delays), sum(delays) / len(delays),
+                          max(delays)))
+    report("Bus monitor: %d busy bits" % (bus.nodes[0].busy_bits,))
+    gaps = bus.get_gaps()[1:]
+    if gaps:
+        report("Inter-frame idle bits: min=%.2f avg=%.2f max=%.2f"
+               % (min(gaps), sum(gaps) / len(gaps), max(gaps)))
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,934 @@
+#!/usr/bin/env python
+# Instruction level simulator for the can2040 rp2040 PIO code
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, re, optparse, ctypes, subprocess
+
+def report(msg):
+    sys.stderr.write(msg + "\n")
+
+CAN2040_C = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                         "..", "src", "can2040.c")
+
+
+######################################################################
+# Program extraction
+######################################################################
+
+# Load the exact PIO instruction words and offsets from can2040.c
+def load_program(filename=CAN2040_C):
+    data = open(filename).read()
+    m = re.search(r"can2040_program_instructions\[\][^=]*= \{(.*?)\};", data, re.S)
+    insns = [int(v, 16) for v in re.findall(r"(0x[0-9a-f]{4}),", m.group(1))]
+    offsets = {}
+    for name, val in re.findall(r"#define can2040_offset_(\w+) (\d+)u", data):
+        offsets[name] = int(val)
+    return insns, offsets
+
+
+######################################################################
+# PIO state machine emulation
+######################################################################
+
+MASK32 = 0xffffffff
+
+# Register bit definitions (as found in the rp2040 datasheet)
+SHIFTCTRL_FJOIN_RX = 1 << 31
+SHIFTCTRL_FJOIN_TX = 1 << 30
+SHIFTCTRL_OUT_SHIFTDIR = 1 << 19
+SHIFTCTRL_IN_SHIFTDIR = 1 << 18
+SHIFTCTRL_AUTOPULL = 1 << 17
+SHIFTCTRL_AUTOPUSH = 1 << 16
+FDEBUG_RXSTALL = 0
+FDEBUG_RXUNDER = 8
+FDEBUG_TXOVER = 16
+FDEBUG_TXSTALL = 24
+
+# Register offsets (as found in the rp2040 datasheet)
+REG_CTRL = 0x000
+REG_FSTAT = 0x004
+REG_FDEBUG = 0x008
+REG_FLEVEL = 0x00c
+REG_TXF0 = 0x010
+REG_RXF0 = 0x020
+REG_IRQ = 0x030
+REG_IRQ_FORCE = 0x034
+REG_INSTR_MEM0 = 0x048
+REG_SM0 = 0x0c8
+REG_SM_SIZE = 0x18
+REG_SM_CLKDIV, REG_SM_EXECCTRL, REG_SM_SHIFTCTRL = 0x00, 0x04, 0x08
+REG_SM_ADDR, REG_SM_INSTR, REG_SM_PINCTRL = 0x0c, 0x10, 0x14
+REG_INTR = 0x128
+REG_INTE0 = 0x12c
+REG_INTF0 = 0x130
+REG_INTS0 = 0x134
+
+def bitrev32(v):
+    return int(format(v & MASK32, '032b')[::-1], 2)
+
+class PIOStateMachine:
+    def __init__(self, pio, idx):
+        self.pio = pio
+        self.idx = idx
+        # Registers (with rp2040 reset values)
+        self.clkdiv = 1 << 16
+        self.execctrl = 0x1f << 12
+        self.shiftctrl = SHIFTCTRL_OUT_SHIFTDIR | SHIFTCTRL_IN_SHIFTDIR
+        self.pinctrl = 5 << 26
+        self.rx_fifo = []
+        self.tx_fifo = []
+        self.restart()
+    def restart(self):
+        self.pc = self.x = self.y = 0
+        self.isr = self.isr_count = 0
+        self.osr = 0
+        self.osr_count = 32
+        self.delay = 0
+        self.exec_insn = None
+        self.irq_waiting = False
+    # Register field helpers
+    def wrap_top(self):
+        return (self.execctrl >> 12) & 0x1f
+    def wrap_bottom(self):
+        return (self.execctrl >> 7) & 0x1f
+    def jmp_pin(self):
+        return (self.execctrl >> 24) & 0x1f
+    def push_thresh(self):
+        return ((self.shiftctrl >> 20) & 0x1f) or 32
+    def pull_thresh(self):
+        return ((self.shiftctrl >> 25) & 0x1f) or 32
+    def rx_depth(self):
+        if self.shiftctrl & SHIFTCTRL_FJOIN_TX:
+            return 0
+        return 8 if self.shiftctrl & SHIFTCTRL_FJOIN_RX else 4
+    def tx_depth(self):
+        if self.shiftctrl & SHIFTCTRL_FJOIN_RX:
+            return 0
+        return 8 if self.shiftctrl & SHIFTCTRL_FJOIN_TX else 4
+    def write_shiftctrl(self, val):
+        joins = SHIFTCTRL_FJOIN_RX | SHIFTCTRL_FJOIN_TX
+        if (val ^ self.shiftctrl) & joins:
+            # Changing the fifo join mode flushes the fifos
+            self.rx_fifo = []
+            self.tx_fifo = []
+        self.shiftctrl = val
+    # Pin access
+    def read_pin(self, pin):
+        return (self.pio.pin_in >> (pin & 0x1f)) & 1
+    def read_in_pins(self):
+        base = (self.pinctrl >> 15) & 0x1f
+        v = self.pio.pin_in
+        return ((v >> base) | (v << (32 - base))) & MASK32
+    def write_pins(self, base, count, val, dirs=False):
+        for i in range(count):
+            pin = (base + i) & 0x1f
+            bit = 1 << pin
+            if dirs:
+                self.pio.pin_dir = (self.pio.pin_dir & ~bit) | (
+                    ((val >> i) & 1) << pin)
+            else:
+                self.pio.pin_out = (self.pio.pin_out & ~bit) | (
+                    ((val >> i) & 1) << pin)
+    def write_out_pins(self, val, dirs=False):
+        base = self.pinctrl & 0x1f
+        count = (self.pinctrl >> 20) & 0x3f
+        self.write_pins(base, count, val, dirs)
+    def write_set_pins(self, val, dirs=False):
+        base = (self.pinctrl >> 5) & 0x1f
+        count = (self.pinctrl >> 26) & 0x7
+        self.write_pins(base, count, val, dirs)
+    # Shift register helpers
+    def shift_in(self, data, count):
+        mask = (1 << count) - 1
+        if self.shiftctrl & SHIFTCTRL_IN_SHIFTDIR:
+            self.isr = ((self.isr >> count) | ((data & mask) << (32 - count))
+                        ) & MASK32 if count < 32 else data & MASK32
+        else:
+            self.isr = ((self.isr << count) | (data & mask)) & MASK32
+        self.isr_count = min(32, self.isr_count + count)
+    def shift_out(self, count):
+        if self.shiftctrl & SHIFTCTRL_OUT_SHIFTDIR:
+            data = self.osr & ((1 << count) - 1)
+            self.osr = (self.osr >> count) if count < 32 else 0
+        else:
+            data = self.osr >> (32 - count)
+            self.osr = (self.osr << count) & MASK32
+        self.osr_count = min(32, self.osr_count + count)
+        return data
+    def read_source(self, source):
+        if source == 0:
+            return self.read_in_pins()
+        elif source == 1:
+            return self.x
+        elif source == 2:
+            return self.y
+        elif source == 5:
+            # MOV STATUS (STATUS_SEL not used by can2040 - always all ones)
+            return MASK32
+        elif source == 6:
+            return self.isr
+        elif source == 7:
+            return self.osr
+        return 0
+    def irq_index(self, idx):
+        if idx & 0x10:
+            return (idx & 0x04) | ((idx + self.idx) & 0x03)
+        return idx & 0x07
+    # Main instruction execution - returns False if instruction stalled
+    def execute(self, insn):
+        pio = self.pio
+        opcode = insn >> 13
+        arg1 = (insn >> 5) & 0x07
+        arg2 = insn & 0x1f
+        if opcode == 0:
+            # JMP
+            if arg1 == 0:
+                take = True
+            elif arg1 == 1:
+                take = not self.x
+            elif arg1 == 2:
+                take = self.x
+                self.x = (self.x - 1) & MASK32
+            elif arg1 == 3:
+                take = not self.y
+            elif arg1 == 4:
+                take = self.y
+                self.y = (self.y - 1) & MASK32
+            elif arg1 == 5:
+                take = self.x != self.y
+            elif arg1 == 6:
+                take = self.read_pin(self.jmp_pin())
+            else:
+                take = self.osr_count < self.pull_thresh()
+            if take:
+                self.next_pc = arg2
+            return True
+        if opcode == 1:
+            # WAIT
+            polarity = (insn >> 7) & 1
+            source = (insn >> 5) & 0x03
+            if source == 0:
+                val = self.read_pin(arg2)
+            elif source == 1:
+                val = self.read_pin(((self.pinctrl >> 15) + arg2) & 0x1f)
+            else:
+                irq = self.irq_index(arg2)
+                val = (pio.cur_irq >> irq) & 1
+                if val and polarity:
+                    pio.irq_clear |= 1 << irq
+            return val == polarity
+        if opcode == 2:
+            # IN
+            count = arg2 or 32
+            autopush = self.shiftctrl & SHIFTCTRL_AUTOPUSH
+            thresh = self.push_thresh()
+            if (autopush and self.isr_count + count >= thresh
+                and len(self.rx_fifo) >= self.rx_depth()):
+                pio.fdebug |= 1 << (FDEBUG_RXSTALL + self.idx)
+                return False
+            self.shift_in(self.read_source(arg1), count)
+            if autopush and self.isr_count >= thresh:
+                self.rx_fifo.append(self.isr)
+                self.isr = self.isr_count = 0
+            return True
+        if opcode == 3:
+            # OUT
+            count = arg2 or 32
+            if (self.shiftctrl & SHIFTCTRL_AUTOPULL
+                and self.osr_count >= self.pull_thresh()):
+                if not self.tx_fifo:
+                    pio.fdebug |= 1 << (FDEBUG_TXSTALL + self.idx)
+                    return False
+                self.osr = self.tx_fifo.pop(0)
+                self.osr_count = 0
+            data = self.shift_out(count)
+            if arg1 == 0:
+                self.write_out_pins(data)
+            elif arg1 == 1:
+                self.x = data
+            elif arg1 == 2:
+                self.y = data
+            elif arg1 == 4:
+                self.write_out_pins(data, dirs=True)
+            elif arg1 == 5:
+                self.next_pc = data & 0x1f
+            elif arg1 == 6:
+                self.isr = data
+                self.isr_count = count
+            elif arg1 == 7:
+                self.exec_insn = data & 0xffff
+            return True
+        if opcode == 4:
+            block = (insn >> 5) & 1
+            ifcond = (insn >> 6) & 1
+            if not (insn & 0x80):
+                # PUSH
+                if ifcond and self.isr_count < self.push_thresh():
+                    return True
+                if len(self.rx_fifo) >= self.rx_depth():
+                    if block:
+                        return False
+                    pio.fdebug |= 1 << (FDEBUG_RXSTALL + self.idx)
+                else:
+                    self.rx_fifo.append(self.isr)
+                self.isr = self.isr_count = 0
+                return True
+            # PULL
+            if ifcond and self.osr_count < self.pull_thresh():
+                return True
+            if not self.tx_fifo:
+                if block:
+                    pio.fdebug |= 1 << (FDEBUG_TXSTALL + self.idx)
+                    return False
+                self.osr = self.x
+            else:
+                self.osr = self.tx_fifo.pop(0)
+            self.osr_count = 0
+            return True
+        if opcode == 5:
+            # MOV
+            op = (insn >> 3) & 0x03
+            val = self.read_source(insn & 0x07)
+            if op == 1:
+                val = ~val & MASK32
+            elif op == 2:
+                val = bitrev32(val)
+            if arg1 == 0:
+                self.write_out_pins(val)
+            elif arg1 == 1:
+                self.x = val
+            elif arg1 == 2:
+                self.y = val
+            elif arg1 == 4:
+                self.exec_insn = val & 0xffff
+            elif arg1 == 5:
+                self.next_pc = val & 0x1f
+            elif arg1 == 6:
+                self.isr = val
+                self.isr_count = 0
+            elif arg1 == 7:
+                self.osr = val
+                self.osr_count = 0
+            return True
+        if opcode == 6:
+            # IRQ
+            irq = self.irq_index(arg2)
+            if insn & 0x40:
+                pio.irq_clear |= 1 << irq
+                return True
+            if self.irq_waiting:
+                if (pio.cur_irq >> irq) & 1:
+                    return False
+                self.irq_waiting = False
+                return True
+            pio.irq_set |= 1 << irq
+            if insn & 0x20:
+                self.irq_waiting = True
+                return False
+            return True
+        # SET
+        if arg1 == 0:
+            self.write_set_pins(arg2)
+        elif arg1 == 1:
+            self.x = arg2
+        elif arg1 == 2:
+            self.y = arg2
+        elif arg1 == 4:
+            self.write_set_pins(arg2, dirs=True)
+        return True
+    # Run an instruction (from instruction memory or SMx_INSTR)
+    def run_insn(self, insn, is_exec):
+        if self.pc == self.wrap_top():
+            self.next_pc = self.wrap_bottom()
+        else:
+            self.next_pc = (self.pc + 1) & 0x1f
+        if is_exec:
+            # Instructions from SMx_INSTR only update pc on a jump
+            self.next_pc = None
+        if not self.execute(insn):
+            return False
+        if self.next_pc is not None:
+            self.pc = self.next_pc
+        return True
+    # Execute one state machine clock cycle
+    def step(self):
+        if self.delay:
+            self.delay -= 1
+            return
+        if self.exec_insn is not None:
+            insn = self.exec_insn
+            if not self.run_insn(insn, True):
+                return
+            if self.exec_insn == insn:
+                self.exec_insn = None
+        else:
+            insn = self.pio.instr_mem[self.pc]
+            if not self.run_insn(insn, False):
+                return
+        self.delay = (insn >> 8) & 0x1f
+
+class PIOBlock:
+    def __init__(self):
+        self.instr_mem = [0] * 32
+        self.sm = [PIOStateMachine(self, i) for i in range(4)]
+        self.enabled = 0
+        self.irq = self.cur_irq = self.irq_set = self.irq_clear = 0
+        self.fdebug = 0
+        self.inte0 = self.intf0 = 0
+        self.pin_in = MASK32
+        self.pin_out = self.pin_dir = 0
+        self.cycle = 0
+    # Register interface (as used by the ARM core)
+    def write_ctrl(self, val):
+        for i in range(4):
+            if val & (1 << (4 + i)):
+                self.sm[i].restart()
+        self.enabled = val & 0x0f
+    def write_instr(self, smi, insn):
+        # Instruction written to SMx_INSTR is executed immediately
+        sm = self.sm[smi]
+        self.cur_irq = self.irq
+        self.irq_set = self.irq_clear = 0
+        sm.exec_insn = None
+        if not sm.run_insn(insn, True):
+            sm.exec_insn = insn
+        self.irq = (self.irq & ~self.irq_clear) | self.irq_set
+    def write_txf(self, smi, val):
+        sm = self.sm[smi]
+        if len(sm.tx_fifo) >= sm.tx_depth():
+            self.fdebug |= 1 << (FDEBUG_TXOVER + smi)
+            return
+        sm.tx_fifo.append(val & MASK32)
+    def read_rxf(self, smi):
+        sm = self.sm[smi]
+        if not sm.rx_fifo:
+            self.fdebug |= 1 << (FDEBUG_RXUNDER + smi)
+            return 0
+        return sm.rx_fifo.pop(0)
+    def write_irq(self, val):
+        self.irq &= ~val
+    def write_irq_force(self, val):
+        self.irq |= val & 0xff
+    def write_fdebug(self, val):
+        self.fdebug &= ~val
+    def read_flevel(self):
+        v = 0
+        for i, sm in enumerate(self.sm):
+            v |= (len(sm.tx_fifo) << (i * 8)) | (len(sm.rx_fifo) << (i*8 + 4))
+        return v
+    def read_intr(self):
+        v = (self.irq & 0x0f) << 8
+        for i, sm in enumerate(self.sm):
+            if sm.rx_fifo:
+                v |= 1 << i
+            if len(sm.tx_fifo) < sm.tx_depth():
+                v |= 1 << (4 + i)
+        return v
+    def read_ints0(self):
+        return (self.read_intr() | self.intf0) & self.inte0
+    def read_fstat(self):
+        v = 0
+        for i, sm in enumerate(self.sm):
+            if len(sm.rx_fifo) >= sm.rx_depth():
+                v |= 1 << i
+            if not sm.rx_fifo:
+                v |= 1 << (8 + i)
+            if len(sm.tx_fifo) >= sm.tx_depth():
+                v |= 1 << (16 + i)
+            if not sm.tx_fifo:
+                v |= 1 << (24 + i)
+        return v
+    # Access a register by its offset (as found in the rp2040 datasheet)
+    def read_reg(self, offset):
+        if offset >= REG_SM0 and offset < REG_SM0 + 4 * REG_SM_SIZE:
+            sm = self.sm[(offset - REG_SM0) // REG_SM_SIZE]
+            reg = (offset - REG_SM0) % REG_SM_SIZE
+            if reg == REG_SM_ADDR:
+                return sm.pc
+            return {REG_SM_CLKDIV: sm.clkdiv, REG_SM_EXECCTRL: sm.execctrl,
+                    REG_SM_SHIFTCTRL: sm.shiftctrl,
+                    REG_SM_PINCTRL: sm.pinctrl}.get(reg, 0)
+        if offset >= REG_RXF0 and offset < REG_RXF0 + 16:
+            return self.read_rxf((offset - REG_RXF0) // 4)
+        return {REG_CTRL: lambda: self.enabled, REG_FSTAT: self.read_fstat,
+                REG_FDEBUG: lambda: self.fdebug, REG_FLEVEL: self.read_flevel,
+                REG_IRQ: lambda: self.irq, REG_INTR: self.read_intr,
+                REG_INTE0: lambda: self.inte0, REG_INTF0: lambda: self.intf0,
+                REG_INTS0: self.read_ints0}.get(offset, lambda: 0)()
+    def write_reg(self, offset, val):
+        if offset >= REG_SM0 and offset < REG_SM0 + 4 * REG_SM_SIZE:
+            smi = (offset - REG_SM0) // REG_SM_SIZE
+            sm = self.sm[smi]
+            reg = (offset - REG_SM0) % REG_SM_SIZE
+            if reg == REG_SM_CLKDIV:
+                sm.clkdiv = val
+            elif reg == REG_SM_EXECCTRL:
+                sm.execctrl = val
+            elif reg == REG_SM_SHIFTCTRL:
+                sm.write_shiftctrl(val)
+            elif reg == REG_SM_INSTR:
+                self.write_instr(smi, val & 0xffff)
+            elif reg == REG_SM_PINCTRL:
+                sm.pinctrl = val
+        elif offset >= REG_TXF0 and offset < REG_TXF0 + 16:
+            self.write_txf((offset - REG_TXF0) // 4, val)
+        elif offset >= REG_INSTR_MEM0 and offset < REG_INSTR_MEM0 + 32 * 4:
+            self.instr_mem[(offset - REG_INSTR_MEM0) // 4] = val & 0xffff
+        elif offset == REG_CTRL:
+            self.write_ctrl(val)
+        elif offset == REG_FDEBUG:
+            self.write_fdebug(val)
+        elif offset == REG_IRQ:
+            self.write_irq(val)
+        elif offset == REG_IRQ_FORCE:
+            self.write_irq_force(val)
+        elif offset == REG_INTE0:
+            self.inte0 = val
+        elif offset == REG_INTF0:
+            self.intf0 = val
+    # Execute one PIO clock cycle (all state machines run in lock step)
+    def step(self, pin_in):
+        self.pin_in = pin_in
+        self.cur_irq = self.irq
+        self.irq_set = self.irq_clear = 0
+        for sm in self.sm:
+            if self.enabled & (1 << sm.idx):
+                sm.step()
+        self.irq = (self.irq & ~self.irq_clear) | self.irq_set
+        self.cycle += 1
+
+
+######################################################################
+# can2040.c host build (see test/Makefile)
+######################################################################
+
+TEST_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                        "..", "test")
+HOSTSIM_LIB = "out/libhostsim.so"
+
+# Register blocks reported to the io hook (see test/hostsim.h)
+HS_PIO0, HS_PIO1, HS_DMA, HS_TIMER = range(4)
+REG_TIMERAWL = 0x28
+
+class can2040_msg(ctypes.Structure):
+    _fields_ = [('id', ctypes.c_uint32), ('dlc', ctypes.c_uint32),
+                ('data', ctypes.c_uint8 * 8)]
+
+class can2040_msg_ts(ctypes.Structure):
+    _fields_ = [('msg', can2040_msg), ('sof_time', ctypes.c_uint32),
+                ('eof_time', ctypes.c_uint32)]
+
+class can2040_stats(ctypes.Structure):
+    _fields_ = [(name, ctypes.c_uint32) for name in [
+        'rx_total', 'tx_total', 'tx_attempt', 'parse_error', 'rx_overrun',
+        'bus_bits', 'stuff_bits', 'id_stats_full', 'tx_queue_max',
+        'notify_dropped']]
+
+can2040_rx_cb = ctypes.CFUNCTYPE(None, ctypes.c_void_p, ctypes.c_uint32,
+                                 ctypes.POINTER(can2040_msg))
+hostsim_io_hook_fn = ctypes.CFUNCTYPE(
+    ctypes.c_int, ctypes.c_uint32, ctypes.c_uint32, ctypes.c_uint32,
+    ctypes.POINTER(ctypes.c_uint32))
+
+U32, PTR = ctypes.c_uint32, ctypes.c_void_p
+HOSTSIM_FUNCS = {
+    'hostsim_io_hook_config': (None, [hostsim_io_hook_fn]),
+    'hostsim_sizeof_can2040': (U32, []),
+    'hostsim_sizeof_stats': (U32, []),
+    'hostsim_sizeof_transmit': (U32, []),
+    'hostsim_pio_start_signal': (None, [PTR, U32]),
+    'hostsim_pio_inject_ack': (None, [PTR, U32, U32]),
+    'can2040_setup': (None, [PTR, U32]),
+    'can2040_callback_config': (None, [PTR, can2040_rx_cb]),
+    'can2040_rx_wake_config': (ctypes.c_int, [PTR, U32]),
+    'can2040_rx_dma_config': (None, [PTR, U32, PTR, U32]),
+    'can2040_tx_queue_config': (None, [PTR, PTR, U32]),
+    'can2040_tx_priority_config': (None, [PTR, U32]),
+    'can2040_timestamp_config': (None, [PTR, U32]),
+    'can2040_listen_only_config': (None, [PTR, U32]),
+    'can2040_start': (None, [PTR, U32, U32, U32, U32]),
+    'can2040_pio_irq_handler': (None, [PTR]),
+    'can2040_check_transmit': (ctypes.c_int, [PTR]),
+    'can2040_transmit': (ctypes.c_int, [PTR, ctypes.POINTER(can2040_msg)]),
+    'can2040_get_statistics': (None, [PTR, ctypes.POINTER(can2040_stats)]),
+}
+
+# Shared library build of can2040.c - the register accesses made by
+# the C code are passed to the node being run (see SimNode.call() )
+class HostSim:
+    def __init__(self):
+        subprocess.check_call(["make", "-s", "-C", TEST_DIR, HOSTSIM_LIB])
+        self.lib = lib = ctypes.CDLL(os.path.join(TEST_DIR, HOSTSIM_LIB))
+        for name, (restype, argtypes) in HOSTSIM_FUNCS.items():
+            func = getattr(lib, name)
+            func.restype = restype
+            func.argtypes = argtypes
+        if lib.hostsim_sizeof_stats() != ctypes.sizeof(can2040_stats):
+            raise Exception("can2040_stats definition out of date")
+        self.cur = None
+        self.io_hook = hostsim_io_hook_fn(self.handle_io)
+        lib.hostsim_io_hook_config(self.io_hook)
+    def handle_io(self, dev, offset, is_write, pval):
+        node = self.cur
+        if node is None:
+            return 0
+        if is_write:
+            return node.io_write(dev, offset, pval[0])
+        val = node.io_read(dev, offset)
+        if val is None:
+            return 0
+        pval[0] = val
+        return 1
+
+HOSTSIM = None
+
+def load_hostsim():
+    global HOSTSIM
+    if HOSTSIM is None:
+        HOSTSIM = HostSim()
+    return HOSTSIM
+
+######################################################################
+# CAN message encoding
+######################################################################
+
+def crc15(bits):
+    crc = 0
+    for bit in bits:
+        if ((crc >> 14) & 1) ^ bit:
+            crc = ((crc << 1) ^ 0x4599) & 0x7fff
+        else:
+            crc = (crc << 1) & 0x7fff
+    return crc
+
+def int_bits(val, count):
+    return [(val >> (count - 1 - i)) & 1 for i in range(count)]
+
+# Return the raw (bit stuffed) bits of a message from SOF to crc delimiter
+def encode_frame(can_id, data, is_ext=False, is_rtr=False, dlc=None):
+    if dlc is None:
+        dlc = len(data)
+    rtr = 1 if is_rtr else 0
+    if is_ext:
+        bits = ([0] + int_bits(can_id >> 18, 11) + [1, 1]
+                + int_bits(can_id & 0x3ffff, 18) + [rtr, 0, 0])
+    else:
+        bits = [0] + int_bits(can_id, 11) + [rtr, 0, 0]
+    bits += int_bits(dlc, 4)
+    if not is_rtr:
+        for d in data:
+            bits += int_bits(d, 8)
+    return stuff_frame(bits)
+
+# Add crc and bit stuffing to the unstuffed bits of a message (SOF to data)
+def stuff_frame(bits):
+    bits = bits + int_bits(crc15(bits), 15)
+    stuffed = []
+    run_val, run_len = 1, 0
+    for b in bits:
+        stuffed.append(b)
+        if b == run_val:
+            run_len += 1
+        else:
+            run_val, run_len = b, 1
+        if run_len == 5:
+            run_val = 1 - b
+            run_len = 1
+            stuffed.append(run_val)
+    return stuffed + [1]
+
+# Extract the unstuffed bits (SOF to end of data) from the raw bits of
+# a message.  Returns None if more raw bits are needed.
+def unstuff_frame(raw):
+    bits = []
+    need = 19
+    run_val, run_len = 1, 0
+    for b in raw:
+        if run_len == 5:
+            # Stuff bit
+            if b == run_val:
+                raise ValueError("bit stuffing error")
+            run_val, run_len = b, 1
+            continue
+        if b == run_val:
+            run_len += 1
+        else:
+            run_val, run_len = b, 1
+        bits.append(b)
+        if len(bits) == 14 and bits[13]:
+            # Extended id
+            need = 39
+        if len(bits) != need:
+            continue
+        if need != 19 and need != 39:
+            return bits
+        # Header complete - determine data length
+        rtr, dlc = bits[need - 7], bits_to_int(bits[need - 4:])
+        if not rtr:
+            need += 8 * min(dlc, 8)
+        if len(bits) == need:
+            return bits
+    return None
+
+def bits_to_int(bits):
+    v = 0
+    for b in bits:
+        v = (v << 1) | b
+    return v
+
+# Pack raw bits into 32bit words for the PIO "tx" fifo (as can2040.c does)
+def pack_words(bits):
+    bits = bits + [1] * (-len(bits) % 32)
+    return [int(''.join(map(str, bits[i:i+32])), 2)
+            for i in range(0, len(bits), 32)]
+
+
+######################################################################
+# Bus simulation
+######################################################################
+
+# A PIO attached to a simulated CAN bus - the PIO is programmed by the
+# can2040.c code (see HostSim)
+class SimNode:
+    def __init__(self, name, sys_clock, bitrate, skew_ppm=0., sync_delay=2):
+        self.name = name
+        self.sys_clock = sys_clock
+        self.bitrate = bitrate
+        self.skew_ppm = skew_ppm
+        self.gpio_rx, self.gpio_tx = 4, 5
+        self.pio = PIOBlock()
+        self.hs = load_hostsim()
+        self.cd = ctypes.create_string_buffer(
+            self.hs.lib.hostsim_sizeof_can2040())
+        self.call('can2040_setup', 0)
+        self.tick_time = None
+        self.next_time = 0.
+        # Input synchronizer (rp2040 has a 2 cycle gpio input delay)
+        self.sync = [1] * sync_delay
+        self.rx_words = []
+        self.irq_log = []
+    # Invoke a can2040.c function for this node
+    def call(self, name, *args):
+        prev_node, self.hs.cur = self.hs.cur, self
+        try:
+            return getattr(self.hs.lib, name)(self.cd, *args)
+        finally:
+            self.hs.cur = prev_node
+    def start(self):
+        self.call('can2040_start', self.sys_clock, self.bitrate,
+                  self.gpio_rx, self.gpio_tx)
+        div = self.pio.sm[0].clkdiv >> 8
+        self.tick_time = (div / 256. / self.sys_clock
+                          * (1. - self.skew_ppm * 1e-6))
+    # Register accesses made by can2040.c (return None / 0 if not handled)
+    def io_read(self, dev, offset):
+        if dev == HS_PIO0:
+            return self.pio.read_reg(offset)
+        if dev == HS_TIMER and offset == REG_TIMERAWL:
+            return int(self.next_time * 1000000.) & MASK32
+        return None
+    def io_write(self, dev, offset, val):
+        if dev == HS_PIO0:
+            self.pio.write_reg(offset, val)
+            return 1
+        return 0
+    def tick(self, line):
+        self.sync.append(line)
+        level = self.sync.pop(0)
+        pio = self.pio
+        prev_irq = pio.irq
+        pin_in = MASK32 & ~((1 - level) << self.gpio_rx)
+        pio.step(pin_in)
+        new_irqs = pio.irq & ~prev_irq
+        if new_irqs:
+            self.irq_log.append((self.next_time, new_irqs))
+        self.next_time += self.tick_time
+    # Driver state of the "CAN tx" gpio (0 for dominant, 1 for recessive)
+    def tx_level(self):
+        bit = 1 << self.gpio_tx
+        if self.pio.pin_dir & bit:
+            return 1 if self.pio.pin_out & bit else 0
+        return 1
+    def level(self, t):
+        return self.tx_level()
+    def drain_rx(self):
+        sm = self.pio.sm[1]
+        while sm.rx_fifo:
+            self.rx_words.append(self.pio.read_rxf(1))
+
+# A scripted transmitter that places raw bits on the bus
+class ScriptNode:
+    def __init__(self, bitrate, skew_ppm=0.):
+        self.bit_time = 1. / bitrate * (1. - skew_ppm * 1e-6)
+        self.segments = []
+    def add_bits(self, start_time, bits):
+        self.segments.append((start_time, bits))
+    def level(self, t):
+        for start, bits in self.segments:
+            if t < start:
+                continue
+            idx = int((t - start) / self.bit_time)
+            if idx < len(bits):
+                return bits[idx]
+        return 1
+
+class Bus:
+    def __init__(self, nodes, scripts=()):
+        self.nodes = nodes
+        self.scripts = list(scripts)
+        self.time = 0.
+        self.history = []
+    def level(self, t):
+        lvl = 1
+        for n in self.nodes:
+            lvl &= n.level(t)
+        for s in self.scripts:
+            lvl &= s.level(t)
+        return lvl
+    def note_transition(self, t, line):
+        self.history.append((t, line))
+    def run_until(self, end_time, callback=None):
+        while 1:
+            node = min(self.nodes, key=lambda n: n.next_time)
+            if node.next_time >= end_time:
+                break
+            self.time = t = node.next_time
+            line = self.level(t)
+            if not self.history or self.history[-1][1] != line:
+                self.note_transition(t, line)
+            node.tick(line)
+            if callback is not None:
+                callback(node)
+        self.time = end_time
+
+
+######################################################################
+# Timing measurements
+######################################################################
+
+def run_rx_check(options, node, bit_time, frame):
+    script = ScriptNode(options.bitrate)
+    start = 20 * bit_time
+    bits = frame + [0, 1] + [1] * 7
+    script.add_bits(start, bits)
+    bus = Bus([node], [script])
+    bus.run_until(start + (len(bits) + 30) * bit_time,
+                  lambda n: n.drain_rx())
+    raw = ''.join([format(w, '010b') for w in node.rx_words])
+    # Up to nine trailing bits may remain in the "rx" isr until next message
+    sent = ''.join(map(str, bits))[:-9]
+    if sent not in raw:
+        report("rx mismatch: sent %s got %s" % (sent, raw))
+        return False
+    report("rx: %d fifo words received; raw bits match bus bits"
+           % (len(node.rx_words),))
+    return True
+
+def measure_maytx(options, slow, bit_time, frame):
+    node = SimNode("n0", options.sys_clock, options.bitrate)
+    node.start()
+    node.call('hostsim_pio_start_signal', slow)
+    script = ScriptNode(options.bitrate)
+    start = 20 * bit_time
+    bits = frame + [0, 1] + [1] * 7
+    script.add_bits(start, bits)
+    bus = Bus([node], [script])
+    last_dom = start + (len(bits) - 8) * bit_time
+    node.pio.write_irq(1)
+    bus.run_until(start + (len(bits) + 40) * bit_time,
+                  lambda n: n.drain_rx())
+    for t, irqs in node.irq_log:
+        if irqs & 1 and t > last_dom:
+            return (t - last_dom) / bit_time
+    return None
+
+def measure_ack(options, bit_time, frame, load_bit):
+    node = SimNode("n0", options.sys_clock, options.bitrate)
+    node.start()
+    script = ScriptNode(options.bitrate)
+    start = 20 * bit_time
+    bits = frame + [1, 1] + [1] * 7
+    script.add_bits(start, bits)
+    bus = Bus([node], [script])
+    # Match key is the last 21 raw bits through crc delimiter
+    raw = [1] * 21 + frame
+    def cb(n):
+        n.drain_rx()
+    # Run until load point, then arm ack injection like can2040.c does
+    load_time = start + load_bit * bit_time
+    bus.run_until(load_time, cb)
+    # Determine position of the crc delimiter in sampled bit counts
+    words = ''.join([format(w, '010b') for w in node.rx_words])
+    isr = node.pio.sm[1]
+    cur = words + (format(isr.isr, '032b')[-isr.isr_count:]
+                   if isr.isr_count else '')
+    sof_pos = cur.find('0')
+    if sof_pos < 0:
+        return None
+    # The PIO position counter is the (zero based) index of the sample
+    crc_end_pos = sof_pos + len(frame) - 1
+    key_bits = int(''.join(map(str, raw[-21:])), 2)
+    if crc_end_pos < len(cur):
+        # Too late - crc delimiter already sampled
+        return None
+    node.call('hostsim_pio_inject_ack', key_bits, crc_end_pos)
+    bus.run_until(start + (len(bits) + 20) * bit_time, cb)
+    # Find when the bus was driven dominant in the ack slot
+    ack_start = start + len(frame) * bit_time
+    ack_time = None
+    for t, lvl in bus.history:
+        if t < ack_start - bit_time:
+            continue
+        if ack_time is None and not lvl:
+            ack_time = t
+        elif ack_time is not None and lvl:
+            return ((ack_time - ack_start) / bit_time,
+                    (t - ack_time) / bit_time)
+    return None
+
+def main():
+    usage = "%prog [options]"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-b", "--bitrate", type="int", dest="bitrate",
+                    default=1000000, help="CAN bus bitrate")
+    opts.add_option("-c", "--sys-clock", type="int", dest="sys_clock",
+                    default=125000000, help="rp2040 system clock")
+    opts.add_option("-i", "--id", type="int", dest="can_id",
+                    default=0x123, help="message id of test message")
+    opts.add_option("-d", "--data", type="string", dest="data",
+                    default="0102030405060708", help="hex data of message")
+    options, args = opts.parse_args()
+    if args:
+        opts.error("Incorrect number of arguments")
+    bit_time = 1. / options.bitrate
+    data = list(bytearray.fromhex(options.data))
+    frame = encode_frame(options.can_id, data)
+    report("Message 0x%x (%d data bytes): %d raw bits (sof to crc delimiter)"
+           % (options.can_id, len(data), len(frame)))
+    # Verify "rx" state machine relays bus bits
+    node = SimNode("n0", options.sys_clock, options.bitrate)
+    node.start()
+    if not run_rx_check(options, node, bit_time, frame):
+        sys.exit(-1)
+    # Measure "maytx" signaling after end of message
+    for slow in [False, True]:
+        r = measure_maytx(options, slow, bit_time, frame)
+        report("maytx (%s start): raised %.2f bit times after last"
+               " dominant bit" % (["normal", "slow"][slow], r))
+    # Measure ack injection and latest time ack injection may be armed
+    last_ok = None
+    for load_bit in range(len(frame) - 30, len(frame) + 1):
+        r = measure_ack(options, bit_time, frame, load_bit)
+        if r is None:
+            break
+        if last_ok is None:
+            report("ack: dominant ack bit driven %+.2f bit times from start"
+                   " of ack slot for %.2f bit times" % r)
+        last_ok = load_bit
+    if last_ok is not None:
+        report("ack: injection may be armed as late as the start of raw"
+               " bit %d (crc delimiter is raw bit %d)"
+               % (last_ok, len(frame) - 1))
+
+if __name__ == '__main__':
+    main()
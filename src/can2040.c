@@ -14,6 +14,8 @@
 #include "hardware/structs/padsbank0.h" // padsbank0_hw
 #include "hardware/structs/pio.h" // pio0_hw
 #include "hardware/structs/resets.h" // RESETS_RESET_PIO0_BITS
+#include "hardware/structs/sio.h" // sio_hw
+#include "hardware/structs/timer.h" // timer_hw
 
 
 /****************************************************************
@@ -27,6 +29,15 @@
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
 #define DIV_ROUND_UP(n,d) (((n) + (d) - 1) / (d))
 
+// Build with -DCAN2040_RAM_IRQ=1 to place irq handling code and data in ram
+#if CAN2040_RAM_IRQ
+#define __irqfunc __attribute__((section(".time_critical.can2040")))
+#define __irqconst __attribute__((section(".data.can2040_const")))
+#else
+#define __irqfunc
+#define __irqconst
+#endif
+
 // Helper functions for writing to "io" memory
 static inline void writel(void *addr, uint32_t val) {
     barrier();
@@ -62,12 +73,115 @@ rp2040_gpio_peripheral(uint32_t gpio, int func, int pull_up)
 }
 
 
+/****************************************************************
+ * rp2040 DMA support (optional rx ring)
+ ****************************************************************/
+
+#define DMA_RX_COUNT 0x80000000 // Transfers per dma channel trigger
+#define DMA_RX_MIN_RING 16 // Smallest rx ring (in entries)
+#define DMA_RX_MAX_RING 8192 // Largest dma address wrap (32KiB)
+#define DMA_NUM_CHANNELS 12
+
+// Return the number of fifo entries dma has copied into the rx ring
+static uint32_t __irqfunc
+dma_rx_get_push_pos(struct can2040 *cd)
+{
+    return DMA_RX_COUNT - dma_hw->ch[cd->rx_dma_chan].transfer_count;
+}
+
+// Read an entry from the rx ring
+static uint32_t __irqfunc
+dma_rx_read(struct can2040 *cd, uint32_t pos)
+{
+    return readl(&cd->rx_dma_ring[pos & (cd->rx_dma_size - 1)]);
+}
+
+// Check if the dma channel is still copying fifo entries to the rx ring
+static int __irqfunc
+dma_rx_is_running(struct can2040 *cd)
+{
+    return dma_hw->ch[cd->rx_dma_chan].ctrl_trig & DMA_CH0_CTRL_TRIG_BUSY_BITS;
+}
+
+// Wait for dma to copy a new fifo entry into the rx ring
+static int __irqfunc
+dma_rx_wait(struct can2040 *cd, uint32_t push_pos)
+{
+    while (dma_rx_get_push_pos(cd) == push_pos)
+        if (!dma_rx_is_running(cd))
+            return -1;
+    return 0;
+}
+
+// Restart the dma channel if it has completed its transfer count
+static uint32_t __irqfunc
+dma_rx_check_restart(struct can2040 *cd, uint32_t push_pos)
+{
+    if (likely(push_pos != DMA_RX_COUNT))
+        return push_pos;
+    // Ring position continues at the start of the ring (count is a multiple
+    // of the ring size) - rebase the pull position to the new transfer count
+    dma_hw->ch[cd->rx_dma_chan].al1_transfer_count_trig = DMA_RX_COUNT;
+    cd->rx_dma_pull_pos -= DMA_RX_COUNT;
+    return 0;
+}
+
+// Drop any entries in the rx ring that have not been processed
+static void __irqfunc
+dma_rx_discard(struct can2040 *cd)
+{
+    cd->rx_dma_pull_pos = dma_rx_get_push_pos(cd);
+}
+
+// Stop the dma channel
+static void
+dma_rx_stop(struct can2040 *cd)
+{
+    uint32_t chan_bit = 1 << cd->rx_dma_chan;
+    dma_channel_hw_t *ch = &dma_hw->ch[cd->rx_dma_chan];
+    hw_clear_bits(&ch->al1_ctrl, DMA_CH0_CTRL_TRIG_EN_BITS);
+    dma_hw->abort = chan_bit;
+    while (dma_hw->abort & chan_bit)
+        ;
+}
+
+// Setup dma channel to copy PIO "rx" fifo entries into the rx ring
+static void
+dma_rx_setup(struct can2040 *cd)
+{
+    rp2040_clear_reset(RESETS_RESET_DMA_BITS);
+    dma_rx_stop(cd);
+
+    uint32_t ring_bits = 2;
+    while ((1u << ring_bits) < cd->rx_dma_size * sizeof(uint32_t))
+        ring_bits++;
+    pio_hw_t *pio_hw = (pio_hw_t *)cd->pio_hw;
+    uint32_t dreq = cd->pio_num ? DREQ_PIO1_RX1 : DREQ_PIO0_RX1;
+    dma_channel_hw_t *ch = &dma_hw->ch[cd->rx_dma_chan];
+    ch->read_addr = (uint32_t)(uintptr_t)&pio_hw->rxf[1];
+    ch->write_addr = (uint32_t)(uintptr_t)cd->rx_dma_ring;
+    ch->transfer_count = DMA_RX_COUNT;
+    cd->rx_dma_pull_pos = 0;
+    ch->ctrl_trig = (
+        dreq << DMA_CH0_CTRL_TRIG_TREQ_SEL_LSB
+        | cd->rx_dma_chan << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB
+        | ring_bits << DMA_CH0_CTRL_TRIG_RING_SIZE_LSB
+        | DMA_CH0_CTRL_TRIG_RING_SEL_BITS
+        | DMA_CH0_CTRL_TRIG_INCR_WRITE_BITS
+        | (DMA_CH0_CTRL_TRIG_DATA_SIZE_VALUE_SIZE_WORD
+           << DMA_CH0_CTRL_TRIG_DATA_SIZE_LSB)
+        | DMA_CH0_CTRL_TRIG_IRQ_QUIET_BITS
+        | DMA_CH0_CTRL_TRIG_HIGH_PRIORITY_BITS
+        | DMA_CH0_CTRL_TRIG_EN_BITS);
+}
+
+
 /****************************************************************
  * rp2040 PIO support
  ****************************************************************/
 
 #define PIO_CLOCK_PER_BIT 32
-#define PIO_RX_WAKE_BITS 10
+#define PIO_RX_WAKE_BITS 10 // Minimum rx fifo entry size (and parse unit)
 
 #define can2040_offset_sync_found_end_of_message 2u
 #define can2040_offset_sync_signal_start 4u
@@ -81,7 +195,7 @@ rp2040_gpio_peripheral(uint32_t gpio, int func, int pull_up)
 #define can2040_offset_tx_got_recessive 25u
 #define can2040_offset_tx_write_pin 27u
 
-static const uint16_t can2040_program_instructions[] = {
+static const uint16_t can2040_program_instructions[] __irqconst = {
     0x0085, //  0: jmp    y--, 5
     0x0048, //  1: jmp    x--, 8
     0xe029, //  2: set    x, 9
@@ -124,10 +238,10 @@ static const uint16_t can2040_program_instructions[] = {
 #define SI_TXPENDING PIO_IRQ0_INTE_SM1_BITS // Misc bit manually forced
 
 // Setup PIO "sync" state machine (state machine 0)
-static void
+static void __irqfunc
 pio_sync_setup(struct can2040 *cd)
 {
-    pio_hw_t *pio_hw = cd->pio_hw;
+    pio_hw_t *pio_hw = (pio_hw_t *)cd->pio_hw;
     struct pio_sm_hw *sm = &pio_hw->sm[0];
     sm->execctrl = (
         cd->gpio_rx << PIO_SM0_EXECCTRL_JMP_PIN_LSB
@@ -144,10 +258,10 @@ pio_sync_setup(struct can2040 *cd)
 }
 
 // Setup PIO "rx" state machine (state machine 1)
-static void
+static void __irqfunc
 pio_rx_setup(struct can2040 *cd)
 {
-    pio_hw_t *pio_hw = cd->pio_hw;
+    pio_hw_t *pio_hw = (pio_hw_t *)cd->pio_hw;
     struct pio_sm_hw *sm = &pio_hw->sm[1];
     sm->execctrl = (
         (can2040_offset_shared_rx_end - 1) << PIO_SM0_EXECCTRL_WRAP_TOP_LSB
@@ -155,16 +269,16 @@ pio_rx_setup(struct can2040 *cd)
     sm->pinctrl = cd->gpio_rx << PIO_SM0_PINCTRL_IN_BASE_LSB;
     sm->shiftctrl = 0; // flush fifo on a restart
     sm->shiftctrl = (PIO_SM0_SHIFTCTRL_FJOIN_RX_BITS
-                     | PIO_RX_WAKE_BITS << PIO_SM0_SHIFTCTRL_PUSH_THRESH_LSB
+                     | cd->rx_wake_bits << PIO_SM0_SHIFTCTRL_PUSH_THRESH_LSB
                      | PIO_SM0_SHIFTCTRL_AUTOPUSH_BITS);
     sm->instr = can2040_offset_shared_rx_read; // jmp shared_rx_read
 }
 
 // Setup PIO "match" state machine (state machine 2)
-static void
+static void __irqfunc
 pio_match_setup(struct can2040 *cd)
 {
-    pio_hw_t *pio_hw = cd->pio_hw;
+    pio_hw_t *pio_hw = (pio_hw_t *)cd->pio_hw;
     struct pio_sm_hw *sm = &pio_hw->sm[2];
     sm->execctrl = (
         (can2040_offset_match_end - 1) << PIO_SM0_EXECCTRL_WRAP_TOP_LSB
@@ -178,10 +292,10 @@ pio_match_setup(struct can2040 *cd)
 }
 
 // Setup PIO "tx" state machine (state machine 3)
-static void
+static void __irqfunc
 pio_tx_setup(struct can2040 *cd)
 {
-    pio_hw_t *pio_hw = cd->pio_hw;
+    pio_hw_t *pio_hw = (pio_hw_t *)cd->pio_hw;
     struct pio_sm_hw *sm = &pio_hw->sm[3];
     sm->execctrl = (
         cd->gpio_rx << PIO_SM0_EXECCTRL_JMP_PIN_LSB
@@ -198,58 +312,118 @@ pio_tx_setup(struct can2040 *cd)
 }
 
 // Set PIO "sync" machine to signal "may transmit" (sm irq 0) on 11 idle bits
-static void
+static void __irqfunc
 pio_sync_normal_start_signal(struct can2040 *cd)
 {
-    pio_hw_t *pio_hw = cd->pio_hw;
+    pio_hw_t *pio_hw = (pio_hw_t *)cd->pio_hw;
     uint32_t eom_idx = can2040_offset_sync_found_end_of_message;
     pio_hw->instr_mem[eom_idx] = 0xe12a; // set x, 10 [1]
 }
 
 // Set PIO "sync" machine to signal "may transmit" (sm irq 0) on 17 idle bits
-static void
+static void __irqfunc
 pio_sync_slow_start_signal(struct can2040 *cd)
 {
-    pio_hw_t *pio_hw = cd->pio_hw;
+    pio_hw_t *pio_hw = (pio_hw_t *)cd->pio_hw;
     uint32_t eom_idx = can2040_offset_sync_found_end_of_message;
     pio_hw->instr_mem[eom_idx] = 0xa127; // mov x, osr [1]
 }
 
 // Test if PIO "rx" state machine has overflowed its fifos
-static int
+static int __irqfunc
 pio_rx_check_stall(struct can2040 *cd)
 {
-    pio_hw_t *pio_hw = cd->pio_hw;
+    pio_hw_t *pio_hw = (pio_hw_t *)cd->pio_hw;
     return pio_hw->fdebug & (1 << (PIO_FDEBUG_RXSTALL_LSB + 1));
 }
 
+// Force PIO "rx" state machine to push the bits held in its isr
+static int __irqfunc
+pio_rx_flush(struct can2040 *cd, uint32_t rx_bit_pos, uint32_t *rx_data)
+{
+    // While the line is idle the PIO "match" state machine isr holds the
+    // current bit position (bits 20-30) and the last 20 bits read.  The
+    // "rx" and "match" state machines read each bit in lock step, so both
+    // are paused (with the "match" isr fully updated) before pushing.
+    pio_hw_t *pio_hw = (pio_hw_t *)cd->pio_hw;
+    uint32_t sm_bits = 0x06 << PIO_CTRL_SM_ENABLE_LSB;
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    for (;;) {
+        hw_clear_bits(&pio_hw->ctrl, sm_bits);
+        uint32_t addr = pio_hw->sm[2].addr;
+        if (addr < can2040_offset_shared_rx_end
+            || addr >= can2040_offset_match_load_next + 2)
+            break;
+        // "match" isr is being rebuilt - let it finish
+        hw_set_bits(&pio_hw->ctrl, sm_bits);
+    }
+    uint32_t dma_pos = cd->rx_dma_pull_pos;
+    if ((cd->rx_dma_ring && dma_rx_get_push_pos(cd) != dma_pos)
+        || !(pio_hw->fstat & (0x02 << PIO_FSTAT_RXEMPTY_LSB))) {
+        // A new fifo entry arrived - it contains the bits held in the isr
+        hw_set_bits(&pio_hw->ctrl, sm_bits);
+        __set_PRIMASK(primask);
+        return 0;
+    }
+    // Pushing empties the "match" isr, losing its last 20 bits.  That is
+    // harmless as this is only used in listen-only mode (rx_wake_bits is
+    // forced to 10 otherwise), where no "match" keys are ever armed.
+    pio_hw->sm[2].instr = 0x8000; // push noblock
+    pio_hw->sm[1].instr = 0x8000; // push noblock
+    uint32_t data = 0;
+    if (!cd->rx_dma_ring) {
+        data = pio_hw->rxf[1];
+    } else if (!dma_rx_wait(cd, dma_pos)) {
+        // Pushed entry is copied into the rx ring by dma
+        data = dma_rx_read(cd, dma_pos);
+        cd->rx_dma_pull_pos = dma_pos + 1;
+    }
+    uint32_t match_bits = pio_hw->rxf[2];
+    hw_set_bits(&pio_hw->ctrl, sm_bits);
+    __set_PRIMASK(primask);
+    if (cd->rx_dma_ring && cd->rx_dma_pull_pos != dma_pos + 1)
+        // Dma channel is not running
+        return -1;
+
+    uint32_t count = (-(match_bits >> 20) - rx_bit_pos) & 0x7ff;
+    if (count >= cd->rx_wake_bits)
+        return -1;
+    uint32_t mask = (1 << count) - 1;
+    if (data & ~mask || (data ^ match_bits) & mask & 0xfffff)
+        // Bits in the two isrs do not agree
+        return -1;
+    *rx_data = data;
+    return count;
+}
+
 // Set PIO "match" state machine to raise a "matched" signal on a bit sequence
-static void
+static void __irqfunc
 pio_match_check(struct can2040 *cd, uint32_t match_key)
 {
-    pio_hw_t *pio_hw = cd->pio_hw;
+    pio_hw_t *pio_hw = (pio_hw_t *)cd->pio_hw;
     pio_hw->txf[2] = match_key;
 }
 
 // Calculate pos+bits identifier for PIO "match" state machine
-static uint32_t
+static uint32_t __irqfunc
 pio_match_calc_key(uint32_t raw_bits, uint32_t rx_bit_pos)
 {
     return (raw_bits & 0x1fffff) | ((-rx_bit_pos) << 21);
 }
 
 // Cancel any pending checks on PIO "match" state machine
-static void
+static void __irqfunc
 pio_match_clear(struct can2040 *cd)
 {
     pio_match_check(cd, 0);
 }
 
 // Flush and halt PIO "tx" state machine
-static void
+static void __irqfunc
 pio_tx_reset(struct can2040 *cd)
 {
-    pio_hw_t *pio_hw = cd->pio_hw;
+    pio_hw_t *pio_hw = (pio_hw_t *)cd->pio_hw;
     pio_hw->ctrl = 0x07 << PIO_CTRL_SM_ENABLE_LSB;
     pio_hw->ctrl = ((0x07 << PIO_CTRL_SM_ENABLE_LSB)
                     | (0x08 << PIO_CTRL_SM_RESTART_LSB));
@@ -262,10 +436,10 @@ pio_tx_reset(struct can2040 *cd)
 }
 
 // Queue a message for transmission on PIO "tx" state machine
-static void
+static void __irqfunc
 pio_tx_send(struct can2040 *cd, uint32_t *data, uint32_t count)
 {
-    pio_hw_t *pio_hw = cd->pio_hw;
+    pio_hw_t *pio_hw = (pio_hw_t *)cd->pio_hw;
     pio_tx_reset(cd);
     pio_hw->instr_mem[can2040_offset_tx_got_recessive] = 0x6021; // out x, 1
     uint32_t i;
@@ -280,10 +454,10 @@ pio_tx_send(struct can2040 *cd, uint32_t *data, uint32_t count)
 }
 
 // Set PIO "tx" state machine to inject an ack after a CRC match
-static void
+static void __irqfunc
 pio_tx_inject_ack(struct can2040 *cd, uint32_t match_key)
 {
-    pio_hw_t *pio_hw = cd->pio_hw;
+    pio_hw_t *pio_hw = (pio_hw_t *)cd->pio_hw;
     pio_tx_reset(cd);
     pio_hw->instr_mem[can2040_offset_tx_got_recessive] = 0xc023; // irq wait 3
     pio_hw->txf[3] = 0x7fffffff;
@@ -298,10 +472,10 @@ pio_tx_inject_ack(struct can2040 *cd, uint32_t match_key)
 }
 
 // Did PIO "tx" state machine unexpectedly finish a transmit attempt?
-static int
+static int __irqfunc
 pio_tx_did_fail(struct can2040 *cd)
 {
-    pio_hw_t *pio_hw = cd->pio_hw;
+    pio_hw_t *pio_hw = (pio_hw_t *)cd->pio_hw;
     // Check for passive/dominant bit conflict without parser noticing
     if (pio_hw->sm[3].addr == can2040_offset_tx_conflict)
         return !(pio_hw->intr & SI_RX_DATA);
@@ -311,10 +485,10 @@ pio_tx_did_fail(struct can2040 *cd)
 }
 
 // Enable host irqs for state machine signals
-static void
+static void __irqfunc
 pio_irq_set(struct can2040 *cd, uint32_t sm_irqs)
 {
-    pio_hw_t *pio_hw = cd->pio_hw;
+    pio_hw_t *pio_hw = (pio_hw_t *)cd->pio_hw;
     pio_hw->inte0 = sm_irqs | SI_RX_DATA;
 }
 
@@ -322,58 +496,77 @@ pio_irq_set(struct can2040 *cd, uint32_t sm_irqs)
 static void
 pio_irq_disable(struct can2040 *cd)
 {
-    pio_hw_t *pio_hw = cd->pio_hw;
+    pio_hw_t *pio_hw = (pio_hw_t *)cd->pio_hw;
     pio_hw->inte0 = 0;
 }
 
 // Return current host irq mask
-static uint32_t
+static uint32_t __irqfunc
 pio_irq_get(struct can2040 *cd)
 {
-    pio_hw_t *pio_hw = cd->pio_hw;
+    pio_hw_t *pio_hw = (pio_hw_t *)cd->pio_hw;
     return pio_hw->inte0;
 }
 
 // Raise the txpending flag
-static void
+static void __irqfunc
 pio_signal_set_txpending(struct can2040 *cd)
 {
-    pio_hw_t *pio_hw = cd->pio_hw;
+    pio_hw_t *pio_hw = (pio_hw_t *)cd->pio_hw;
     pio_hw->irq_force = SI_TXPENDING >> 8;
 }
 
 // Clear the txpending flag
-static void
+static void __irqfunc
 pio_signal_clear_txpending(struct can2040 *cd)
 {
-    pio_hw_t *pio_hw = cd->pio_hw;
+    pio_hw_t *pio_hw = (pio_hw_t *)cd->pio_hw;
     pio_hw->irq = SI_TXPENDING >> 8;
 }
 
 // Setup PIO state machines
-static void
+static void __irqfunc
 pio_sm_setup(struct can2040 *cd)
 {
     // Reset state machines
-    pio_hw_t *pio_hw = cd->pio_hw;
-    pio_hw->ctrl = PIO_CTRL_SM_RESTART_BITS | PIO_CTRL_CLKDIV_RESTART_BITS;
-    pio_hw->fdebug = 0xffffffff;
-    pio_hw->irq = 0xff;
-    pio_signal_set_txpending(cd);
+    pio_hw_t *pio_hw = (pio_hw_t *)cd->pio_hw;
+    uint32_t count = ARRAY_SIZE(can2040_program_instructions);
+    if (cd->listen_only) {
+        // Leave PIO "tx" state machine (and its instructions) to the user
+        hw_clear_bits(&pio_hw->ctrl, 0x07 << PIO_CTRL_SM_ENABLE_LSB);
+        hw_set_bits(&pio_hw->ctrl, (0x07 << PIO_CTRL_SM_RESTART_LSB)
+                    | (0x07 << PIO_CTRL_CLKDIV_RESTART_LSB));
+        pio_hw->fdebug = 0x07070707;
+        pio_hw->irq = 0x1f;
+        count = can2040_offset_match_end;
+    } else {
+        pio_hw->ctrl = PIO_CTRL_SM_RESTART_BITS | PIO_CTRL_CLKDIV_RESTART_BITS;
+        pio_hw->fdebug = 0xffffffff;
+        pio_hw->irq = 0xff;
+        pio_signal_set_txpending(cd);
+    }
 
     // Load pio program
     uint32_t i;
-    for (i=0; i<ARRAY_SIZE(can2040_program_instructions); i++)
+    for (i=0; i<count; i++)
         pio_hw->instr_mem[i] = can2040_program_instructions[i];
 
     // Set initial state machine state
     pio_sync_setup(cd);
     pio_rx_setup(cd);
     pio_match_setup(cd);
-    pio_tx_setup(cd);
+    if (!cd->listen_only)
+        pio_tx_setup(cd);
 
     // Start state machines
-    pio_hw->ctrl = 0x07 << PIO_CTRL_SM_ENABLE_LSB;
+    if (cd->listen_only)
+        hw_set_bits(&pio_hw->ctrl, 0x07 << PIO_CTRL_SM_ENABLE_LSB);
+    else
+        pio_hw->ctrl = 0x07 << PIO_CTRL_SM_ENABLE_LSB;
+
+    // Entries already copied to the rx dma ring are now stale
+    if (cd->rx_dma_ring)
+        dma_rx_discard(cd);
 }
 
 // Initial setup of gpio pins and PIO state machines
@@ -385,19 +578,22 @@ pio_setup(struct can2040 *cd, uint32_t sys_clock, uint32_t bitrate)
     rp2040_clear_reset(rb);
 
     // Setup and sync pio state machine clocks
-    pio_hw_t *pio_hw = cd->pio_hw;
+    pio_hw_t *pio_hw = (pio_hw_t *)cd->pio_hw;
     uint32_t div = (256 / PIO_CLOCK_PER_BIT) * sys_clock / bitrate;
-    int i;
-    for (i=0; i<4; i++)
+    int i, sm_count = cd->listen_only ? 3 : 4;
+    for (i=0; i<sm_count; i++)
         pio_hw->sm[i].clkdiv = div << PIO_SM0_CLKDIV_FRAC_LSB;
 
     // Configure state machines
     pio_sm_setup(cd);
+    if (cd->rx_dma_ring)
+        dma_rx_setup(cd);
 
     // Map Rx/Tx gpios
     uint32_t pio_func = cd->pio_num ? 7 : 6;
     rp2040_gpio_peripheral(cd->gpio_rx, pio_func, 1);
-    rp2040_gpio_peripheral(cd->gpio_tx, pio_func, 0);
+    if (!cd->listen_only)
+        rp2040_gpio_peripheral(cd->gpio_tx, pio_func, 0);
 }
 
 
@@ -406,7 +602,7 @@ pio_setup(struct can2040 *cd, uint32_t sys_clock, uint32_t bitrate)
  ****************************************************************/
 
 // Calculated 8-bit crc table (see scripts/crc.py)
-static const uint16_t crc_table[256] = {
+static const uint16_t crc_table[256] __irqconst = {
     0x0000,0x4599,0x4eab,0x0b32,0x58cf,0x1d56,0x1664,0x53fd,0x7407,0x319e,
     0x3aac,0x7f35,0x2cc8,0x6951,0x6263,0x27fa,0x2d97,0x680e,0x633c,0x26a5,
     0x7558,0x30c1,0x3bf3,0x7e6a,0x5990,0x1c09,0x173b,0x52a2,0x015f,0x44c6,
@@ -436,14 +632,14 @@ static const uint16_t crc_table[256] = {
 };
 
 // Update a crc with 8 bits of data
-static uint32_t
+static uint32_t __irqfunc
 crc_byte(uint32_t crc, uint32_t data)
 {
     return (crc << 8) ^ crc_table[((crc >> 7) ^ data) & 0xff];
 }
 
 // Update a crc with 8, 16, 24, or 32 bits of data
-static inline uint32_t
+static inline uint32_t __irqfunc
 crc_bytes(uint32_t crc, uint32_t data, uint32_t num)
 {
     switch (num) {
@@ -461,7 +657,7 @@ crc_bytes(uint32_t crc, uint32_t data, uint32_t num)
  ****************************************************************/
 
 // Add 'count' number of bits from 'data' to the 'bu' unstuffer
-static void
+static void __irqfunc
 unstuf_add_bits(struct can2040_bitunstuffer *bu, uint32_t data, uint32_t count)
 {
     uint32_t mask = (1 << count) - 1;
@@ -470,7 +666,7 @@ unstuf_add_bits(struct can2040_bitunstuffer *bu, uint32_t data, uint32_t count)
 }
 
 // Reset state and set the next desired 'num_bits' unstuffed bits to extract
-static void
+static void __irqfunc
 unstuf_set_count(struct can2040_bitunstuffer *bu, uint32_t num_bits)
 {
     bu->unstuffed_bits = 0;
@@ -478,7 +674,7 @@ unstuf_set_count(struct can2040_bitunstuffer *bu, uint32_t num_bits)
 }
 
 // Clear bitstuffing state (used after crc field to avoid bitstuffing ack field)
-static void
+static void __irqfunc
 unstuf_clear_state(struct can2040_bitunstuffer *bu)
 {
     uint32_t lb = 1 << bu->count_stuff;
@@ -486,7 +682,7 @@ unstuf_clear_state(struct can2040_bitunstuffer *bu)
 }
 
 // Restore raw bitstuffing state (used to undo unstuf_clear_state() )
-static void
+static void __irqfunc
 unstuf_restore_state(struct can2040_bitunstuffer *bu, uint32_t data)
 {
     uint32_t cs = bu->count_stuff;
@@ -494,7 +690,7 @@ unstuf_restore_state(struct can2040_bitunstuffer *bu, uint32_t data)
 }
 
 // Pull bits from unstuffer (as specified in unstuf_set_count() )
-static int
+static int __irqfunc
 unstuf_pull_bits(struct can2040_bitunstuffer *bu)
 {
     uint32_t sb = bu->stuffed_bits, edges = sb ^ (sb >> 1);
@@ -540,7 +736,7 @@ unstuf_pull_bits(struct can2040_bitunstuffer *bu)
 }
 
 // Return most recent raw (still stuffed) bits
-static uint32_t
+static uint32_t __irqfunc
 unstuf_get_raw(struct can2040_bitunstuffer *bu)
 {
     return bu->stuffed_bits >> bu->count_stuff;
@@ -552,7 +748,7 @@ unstuf_get_raw(struct can2040_bitunstuffer *bu)
  ****************************************************************/
 
 // Stuff 'num_bits' bits in '*pb' - upper bits must already be stuffed
-static uint32_t
+static uint32_t __irqfunc
 bitstuff(uint32_t *pb, uint32_t num_bits)
 {
     uint32_t b = *pb, count = num_bits;
@@ -645,14 +841,98 @@ enum {
 };
 
 // Calculate queue array position from a transmit index
-static uint32_t
+static uint32_t __irqfunc
 tx_qpos(struct can2040 *cd, uint32_t pos)
 {
-    return pos % ARRAY_SIZE(cd->tx_queue);
+    return pos & (cd->tx_queue_size - 1);
+}
+
+// Return a value that orders messages by CAN bus arbitration priority
+static uint32_t __irqfunc
+tx_arb_key(uint32_t id)
+{
+    uint32_t rtr = !!(id & CAN2040_ID_RTR);
+    if (id & CAN2040_ID_EFF)
+        // 11 bit base id, srr, ide, 18 bit extended id, rtr
+        return (((id & 0x1ffc0000) << 3) | (0x03 << 19)
+                | ((id & 0x3ffff) << 1) | rtr);
+    // 11 bit id, rtr, ide
+    return ((id & 0x7ff) << 21) | (rtr << 20);
+}
+
+// Check if the message in slot 'a' should be sent before slot 'b'
+static int __irqfunc
+tx_heap_less(struct can2040 *cd, uint32_t a, uint32_t b)
+{
+    struct can2040_transmit *qa = &cd->tx_queue[a], *qb = &cd->tx_queue[b];
+    uint32_t key_a = tx_arb_key(qa->msg.id), key_b = tx_arb_key(qb->msg.id);
+    if (key_a != key_b)
+        return key_a < key_b;
+    // Same id - send in the order submitted
+    return (int32_t)(qa->seq - qb->seq) < 0;
+}
+
+// Add new messages to the heap of queued messages (ordered by priority)
+static void __irqfunc
+tx_heap_add_new(struct can2040 *cd)
+{
+    struct can2040_transmit *tq = cd->tx_queue;
+    uint32_t tx_push_pos = readl(&cd->tx_push_pos);
+    while (cd->tx_heap_pos != tx_push_pos) {
+        uint32_t pos = cd->tx_heap_pos++;
+        uint32_t slot = tq[tx_qpos(cd, pos)].free_slot;
+        tq[slot].seq = pos;
+        // Move the new slot up from the bottom of the heap
+        uint32_t i = cd->tx_heap_count++;
+        while (i) {
+            uint32_t parent = (i - 1) / 2, pslot = tq[parent].heap_slot;
+            if (!tx_heap_less(cd, slot, pslot))
+                break;
+            tq[i].heap_slot = pslot;
+            i = parent;
+        }
+        tq[i].heap_slot = slot;
+    }
+}
+
+// Remove the top (highest priority) slot from the heap
+static void __irqfunc
+tx_heap_pop(struct can2040 *cd)
+{
+    struct can2040_transmit *tq = cd->tx_queue;
+    uint32_t count = --cd->tx_heap_count, slot = tq[count].heap_slot, i = 0;
+    for (;;) {
+        uint32_t child = i * 2 + 1;
+        if (child >= count)
+            break;
+        uint32_t cslot = tq[child].heap_slot;
+        if (child + 1 < count && tx_heap_less(cd, tq[child + 1].heap_slot
+                                              , cslot))
+            cslot = tq[++child].heap_slot;
+        if (!tx_heap_less(cd, cslot, slot))
+            break;
+        tq[i].heap_slot = cslot;
+        i = child;
+    }
+    tq[i].heap_slot = slot;
+}
+
+// Remove the current transmit message from the transmit queue
+static void __irqfunc
+tx_note_sent(struct can2040 *cd)
+{
+    if (cd->tx_priority)
+        // The current message is always the top of the heap
+        tx_heap_pop(cd);
+    // Return the slot for use by can2040_transmit()
+    uint32_t tx_pull_pos = cd->tx_pull_pos;
+    cd->tx_queue[tx_qpos(cd, tx_pull_pos)].free_slot = cd->tx_cur_slot;
+    __DMB();
+    writel(&cd->tx_pull_pos, tx_pull_pos + 1);
 }
 
 // Queue the next message for transmission in the PIO
-static uint32_t
+static uint32_t __irqfunc
 tx_schedule_transmit(struct can2040 *cd)
 {
     if (cd->tx_state == TS_QUEUED && !pio_tx_did_fail(cd))
@@ -671,13 +951,21 @@ tx_schedule_transmit(struct can2040 *cd)
     }
     cd->tx_state = TS_QUEUED;
     cd->stats.tx_attempt++;
-    struct can2040_transmit *qt = &cd->tx_queue[tx_qpos(cd, tx_pull_pos)];
+    uint32_t tx_cur_slot;
+    if (cd->tx_priority) {
+        tx_heap_add_new(cd);
+        tx_cur_slot = cd->tx_queue[0].heap_slot;
+    } else {
+        tx_cur_slot = cd->tx_queue[tx_qpos(cd, tx_pull_pos)].free_slot;
+    }
+    cd->tx_cur_slot = tx_cur_slot;
+    struct can2040_transmit *qt = &cd->tx_queue[tx_cur_slot];
     pio_tx_send(cd, qt->stuffed_data, qt->stuffed_words);
     return 0;
 }
 
 // Setup PIO state for ack injection
-static void
+static void __irqfunc
 tx_inject_ack(struct can2040 *cd, uint32_t match_key)
 {
     cd->tx_state = TS_ACKING_RX;
@@ -685,13 +973,13 @@ tx_inject_ack(struct can2040 *cd, uint32_t match_key)
 }
 
 // Check if the current parsed message is feedback from current transmit
-static int
+static int __irqfunc
 tx_check_local_message(struct can2040 *cd)
 {
     if (cd->tx_state != TS_QUEUED)
         return 0;
-    struct can2040_transmit *qt = &cd->tx_queue[tx_qpos(cd, cd->tx_pull_pos)];
-    struct can2040_msg *pm = &cd->parse_msg, *tm = &qt->msg;
+    struct can2040_transmit *qt = &cd->tx_queue[cd->tx_cur_slot];
+    struct can2040_msg *pm = cd->parse_slot, *tm = &qt->msg;
     if (tm->id == pm->id) {
         if (qt->crc != cd->parse_crc || tm->dlc != pm->dlc
             || tm->data32[0] != pm->data32[0] || tm->data32[1] != pm->data32[1])
@@ -705,6 +993,111 @@ tx_check_local_message(struct can2040 *cd)
 }
 
 
+/****************************************************************
+ * Timestamps
+ ****************************************************************/
+
+// Note the current time and the raw bit position of the last PIO rx push
+static void __irqfunc
+ts_note_irq(struct can2040 *cd)
+{
+    pio_hw_t *pio_hw = (pio_hw_t *)cd->pio_hw;
+    uint32_t now = timer_hw->timerawl;
+    uint32_t level = ((pio_hw->flevel & PIO_FLEVEL_RX1_BITS)
+                      >> PIO_FLEVEL_RX1_LSB);
+    if (cd->rx_dma_ring)
+        level += dma_rx_get_push_pos(cd) - cd->rx_dma_pull_pos;
+    if (!level)
+        // Irq not raised by an rx push - the PIO may hold an unknown
+        // number of unpushed bits, so keep the previous reference point
+        return;
+    // All pending entries were pushed since the last irq completed, so
+    // the newest push occurred within the irq latency of this irq
+    cd->ts_time = now;
+    cd->ts_bitpos = cd->raw_bit_count + level * cd->rx_wake_bits;
+}
+
+// Convert a raw bit position to a time (in microseconds)
+static uint32_t __irqfunc
+ts_calc(struct can2040 *cd, uint32_t bitpos)
+{
+    int32_t bits = bitpos - cd->ts_bitpos;
+    // Multiply the whole and fractional parts of ts_bit_time separately
+    // (limiting the bit count) so that the products can not overflow
+    if (bits > 0x7fff)
+        bits = 0x7fff;
+    else if (bits < -0x7fff)
+        bits = -0x7fff;
+    uint32_t bit_time = cd->ts_bit_time;
+    int32_t us = bits * (int32_t)(bit_time >> 16);
+    us += (bits * (int32_t)(bit_time & 0xffff)) >> 16;
+    return cd->ts_time + us;
+}
+
+
+/****************************************************************
+ * Per-id statistics
+ ****************************************************************/
+
+#define IDSTATS_MAX_PROBE 8
+
+// Find (or optionally add) the statistics table entry for an id
+static struct can2040_id_stats * __irqfunc
+idstats_lookup(struct can2040 *cd, uint32_t id, int add)
+{
+    struct can2040_id_stats *table = cd->id_stats;
+    uint32_t key = id & ~CAN2040_ID_RTR, mask = cd->id_stats_size - 1;
+    uint32_t pos = (key * 2654435761u) >> 16, i;
+    for (i=0; i<IDSTATS_MAX_PROBE; i++, pos++) {
+        struct can2040_id_stats *is = &table[pos & mask];
+        if (!is->frames) {
+            // Empty entry - id not in table
+            if (!add)
+                return NULL;
+            is->id = key;
+            return is;
+        }
+        if (is->id == key)
+            return is;
+    }
+    return NULL;
+}
+
+// Note a completed (rx or tx) message in the per-id statistics
+static void __irqfunc
+idstats_note_message(struct can2040 *cd)
+{
+    struct can2040_msg *pm = cd->parse_slot;
+    struct can2040_id_stats *is = idstats_lookup(cd, pm->id, 1);
+    if (!is) {
+        cd->stats.id_stats_full++;
+        return;
+    }
+    uint32_t now = timer_hw->timerawl, frames = is->frames;
+    if (frames) {
+        uint32_t interval = now - is->last_time;
+        if (frames == 1 || interval < is->min_interval)
+            is->min_interval = interval;
+        if (interval > is->max_interval)
+            is->max_interval = interval;
+    }
+    is->last_time = now;
+    if (!(pm->id & CAN2040_ID_RTR))
+        is->bytes += pm->dlc > 8 ? 8 : pm->dlc;
+    is->frames = frames + 1;
+}
+
+// Note a parse error (after the id was read) in the per-id statistics
+static void __irqfunc
+idstats_note_error(struct can2040 *cd)
+{
+    // Only update existing entries (the id may have been corrupted)
+    struct can2040_id_stats *is = idstats_lookup(cd, cd->parse_slot->id, 0);
+    if (is)
+        is->errors++;
+}
+
+
 /****************************************************************
  * Notification callbacks
  ****************************************************************/
@@ -718,41 +1111,174 @@ enum {
     RS_NEED_TX_EOF = RS_NEED_TX_ACK | RS_NEED_EOF_FLAG,
 };
 
+// Invoke callback (or queue it for can2040_process() if deferred)
+static void __irqfunc
+report_callback(struct can2040 *cd, uint32_t notify, struct can2040_msg *msg)
+{
+    if (unlikely(!cd->rx_cb)) {
+        // Only polling the rx queue - no callback to report to
+        cd->stats.notify_dropped++;
+        return;
+    }
+    if (likely(!cd->defer_flags)) {
+        cd->rx_cb(cd, notify, msg);
+        return;
+    }
+    uint32_t push_pos = cd->defer_push_pos;
+    uint32_t pending = push_pos - readl(&cd->defer_pull_pos);
+    if (pending >= cd->defer_queue_size) {
+        // Queue full - can2040_process() will report an error
+        writel(&cd->defer_lost, cd->defer_lost + 1);
+        return;
+    }
+    uint32_t pos = push_pos & (cd->defer_queue_size - 1);
+    struct can2040_notification *qn = &cd->defer_queue[pos];
+    qn->notify = notify;
+    qn->msg.msg.id = msg->id;
+    qn->msg.msg.dlc = msg->dlc;
+    qn->msg.msg.data32[0] = msg->data32[0];
+    qn->msg.msg.data32[1] = msg->data32[1];
+    if (cd->ts_bit_time) {
+        struct can2040_msg_ts *tm = (struct can2040_msg_ts *)msg;
+        qn->msg.sof_time = tm->sof_time;
+        qn->msg.eof_time = tm->eof_time;
+    }
+    __DMB();
+    writel(&cd->defer_push_pos, push_pos + 1);
+
+    if (cd->defer_flags & CAN2040_DEFER_WAKE_SEV)
+        // Wake the other ARM core (if it is waiting in a "wfe" instruction)
+        __SEV();
+}
+
 // Report error to calling code (via callback interface)
-static void
+static void __irqfunc
 report_callback_error(struct can2040 *cd, uint32_t error_code)
 {
-    struct can2040_msg msg = {};
-    cd->rx_cb(cd, CAN2040_NOTIFY_ERROR | error_code, &msg);
+    struct can2040_msg_ts msg = {};
+    report_callback(cd, CAN2040_NOTIFY_ERROR | error_code, &msg.msg);
+}
+
+// Select where the parser stores the next message
+static struct can2040_msg * __irqfunc
+report_get_parse_slot(struct can2040 *cd)
+{
+    if (likely(!cd->rx_queue))
+        return &cd->parse_msg;
+    // Parse directly into the next free rx queue entry (if available)
+    uint32_t push_pos = cd->rx_push_pos;
+    uint32_t pending = push_pos - readl(&cd->rx_pull_pos);
+    if (pending >= cd->rx_queue_size)
+        return &cd->parse_msg;
+    return &cd->rx_queue[push_pos & (cd->rx_queue_size - 1)];
+}
+
+// Report a parsed message to calling code (adding timestamps if enabled)
+static void __irqfunc
+report_callback_msg(struct can2040 *cd, uint32_t notify)
+{
+    struct can2040_msg *pm = cd->parse_slot;
+    if (likely(!cd->ts_bit_time)) {
+        report_callback(cd, notify, pm);
+        return;
+    }
+    struct can2040_msg_ts *tm = &cd->report_msg;
+    tm->msg.id = pm->id;
+    tm->msg.dlc = pm->dlc;
+    tm->msg.data32[0] = pm->data32[0];
+    tm->msg.data32[1] = pm->data32[1];
+    tm->sof_time = ts_calc(cd, cd->parse_sof_pos);
+    tm->eof_time = ts_calc(cd, cd->parse_crc_pos + 10);
+    report_callback(cd, notify, &tm->msg);
+}
+
+// Add a received message to the rx queue (for can2040_rx_poll() )
+static void __irqfunc
+report_queue_rx_msg(struct can2040 *cd)
+{
+    uint32_t push_pos = cd->rx_push_pos;
+    struct can2040_msg *pm = cd->parse_slot;
+    if (pm == &cd->parse_msg) {
+        // Queue was full at start of message - copy to queue if now space
+        uint32_t pending = push_pos - readl(&cd->rx_pull_pos);
+        if (pending >= cd->rx_queue_size) {
+            // Queue full - discard message
+            cd->stats.rx_overrun++;
+            return;
+        }
+        struct can2040_msg *qm = &cd->rx_queue[push_pos
+                                               & (cd->rx_queue_size - 1)];
+        qm->id = pm->id;
+        qm->dlc = pm->dlc;
+        qm->data32[0] = pm->data32[0];
+        qm->data32[1] = pm->data32[1];
+    }
+    // Message already in queue entry - just need to publish it
+    cd->stats.rx_total++;
+    __DMB();
+    writel(&cd->rx_push_pos, push_pos + 1);
 }
 
 // Report a received message to calling code (via callback interface)
-static void
+static void __irqfunc
 report_callback_rx_msg(struct can2040 *cd)
 {
+    if (cd->rx_queue) {
+        report_queue_rx_msg(cd);
+        return;
+    }
     cd->stats.rx_total++;
-    cd->rx_cb(cd, CAN2040_NOTIFY_RX, &cd->parse_msg);
+    report_callback_msg(cd, CAN2040_NOTIFY_RX);
 }
 
 // Report a message that was successfully transmited (via callback interface)
-static void
+static void __irqfunc
 report_callback_tx_msg(struct can2040 *cd)
 {
-    writel(&cd->tx_pull_pos, cd->tx_pull_pos + 1);
+    tx_note_sent(cd);
     cd->stats.tx_total++;
-    cd->rx_cb(cd, CAN2040_NOTIFY_TX, &cd->parse_msg);
+    report_callback_msg(cd, CAN2040_NOTIFY_TX);
+}
+
+// Note the bus is idle - count the raw bits used since the first sof
+static void __irqfunc
+report_note_bus_idle(struct can2040 *cd, uint32_t end_pos)
+{
+    if (!cd->bus_busy)
+        return;
+    cd->bus_busy = 0;
+    cd->stats.bus_bits += end_pos - cd->bus_busy_pos;
+}
+
+// Note the raw bits (and stuff bits) a message used on the CAN bus
+static void __irqfunc
+report_note_bus_bits(struct can2040 *cd)
+{
+    struct can2040_msg *pm = cd->parse_slot;
+    uint32_t id = pm->id, dlc = pm->dlc > 8 ? 8 : pm->dlc;
+    // Unstuffed bits from sof to end of eof (excluding 3 bit intermission)
+    uint32_t nominal = (id & CAN2040_ID_EFF ? 64 : 44);
+    if (!(id & CAN2040_ID_RTR))
+        nominal += dlc * 8;
+    uint32_t raw = cd->parse_crc_pos + 10 - cd->parse_sof_pos;
+    cd->stats.stuff_bits += raw - nominal;
+    // Bus is idle after the 3 bit intermission
+    report_note_bus_idle(cd, cd->parse_crc_pos + 10 + 3);
 }
 
 // EOF phase complete - report message (rx or tx) to calling code
-static void
+static void __irqfunc
 report_handle_eof(struct can2040 *cd)
 {
     if (cd->report_state & RS_NEED_EOF_FLAG) { // RS_NEED_xX_EOF
         // Successfully processed a new message - report to calling code
         pio_sync_normal_start_signal(cd);
+        report_note_bus_bits(cd);
+        if (cd->id_stats)
+            idstats_note_message(cd);
         if (cd->report_state == RS_NEED_TX_EOF)
             report_callback_tx_msg(cd);
-        else
+        else if (cd->parse_accept)
             report_callback_rx_msg(cd);
     }
     cd->report_state = RS_IDLE;
@@ -760,23 +1286,29 @@ report_handle_eof(struct can2040 *cd)
 }
 
 // Check if message being processed is an rx message (not self feedback from tx)
-static int
+static int __irqfunc
 report_is_not_in_tx(struct can2040 *cd)
 {
     return !(cd->report_state & RS_NEED_TX_ACK);
 }
 
 // Parser found a new message start
-static void
+static void __irqfunc
 report_note_message_start(struct can2040 *cd)
 {
     pio_irq_set(cd, SI_MAYTX);
 }
 
 // Setup for ack injection (if receiving) or ack confirmation (if transmit)
-static int
+static int __irqfunc
 report_note_crc_start(struct can2040 *cd)
 {
+    if (cd->listen_only) {
+        // No ack injection - just report the message after its eof
+        cd->report_state = RS_NEED_RX_ACK;
+        return 0;
+    }
+
     int ret = tx_check_local_message(cd);
     if (ret) {
         if (ret < 0)
@@ -796,7 +1328,7 @@ report_note_crc_start(struct can2040 *cd)
 }
 
 // Parser successfully found matching crc
-static void
+static void __irqfunc
 report_note_crc_success(struct can2040 *cd)
 {
     if (cd->report_state == RS_NEED_TX_ACK)
@@ -805,7 +1337,7 @@ report_note_crc_success(struct can2040 *cd)
 }
 
 // Parser found successful ack
-static void
+static void __irqfunc
 report_note_ack_success(struct can2040 *cd)
 {
     if (cd->report_state == RS_IDLE)
@@ -816,7 +1348,7 @@ report_note_ack_success(struct can2040 *cd)
 }
 
 // Parser found successful EOF
-static void
+static void __irqfunc
 report_note_eof_success(struct can2040 *cd)
 {
     if (cd->report_state == RS_IDLE)
@@ -827,7 +1359,7 @@ report_note_eof_success(struct can2040 *cd)
 }
 
 // Parser found unexpected data on input
-static void
+static void __irqfunc
 report_note_discarding(struct can2040 *cd)
 {
     if (cd->report_state != RS_IDLE) {
@@ -839,7 +1371,7 @@ report_note_discarding(struct can2040 *cd)
 }
 
 // Received PIO rx "ackdone" irq
-static void
+static void __irqfunc
 report_line_ackdone(struct can2040 *cd)
 {
     // Setup "matched" irq for fast rx callbacks
@@ -851,7 +1383,7 @@ report_line_ackdone(struct can2040 *cd)
 }
 
 // Received PIO "matched" irq
-static void
+static void __irqfunc
 report_line_matched(struct can2040 *cd)
 {
     // A match event indicates an ack and eof are present
@@ -866,7 +1398,7 @@ report_line_matched(struct can2040 *cd)
 }
 
 // Received 10+ passive bits on the line (between 10 and 17 bits)
-static void
+static void __irqfunc
 report_line_maytx(struct can2040 *cd)
 {
     // Line is idle - may be unexpected EOF, missed ack injection,
@@ -878,7 +1410,7 @@ report_line_maytx(struct can2040 *cd)
 }
 
 // Schedule a transmit
-static void
+static void __irqfunc
 report_line_txpending(struct can2040 *cd)
 {
     uint32_t pio_irqs = pio_irq_get(cd);
@@ -897,6 +1429,60 @@ report_line_txpending(struct can2040 *cd)
 }
 
 
+/****************************************************************
+ * Acceptance filtering
+ ****************************************************************/
+
+// Check if a received message id passes an id/mask filter bank
+static int __irqfunc
+filter_check_bank(struct can2040_filter *filters, uint32_t count, uint32_t id)
+{
+    if (!count)
+        // No filters configured - accept all messages
+        return 1;
+    uint32_t i;
+    for (i=0; i<count; i++)
+        if (!((id ^ filters[i].id) & filters[i].mask))
+            return 1;
+    return 0;
+}
+
+// Check if a 29-bit id is in a sorted table of non-overlapping ranges
+static int __irqfunc
+filter_check_ranges(struct can2040_filter_range *ranges, uint32_t count
+                    , uint32_t id)
+{
+    // Binary search for the last range with a start at or below id
+    struct can2040_filter_range *r = ranges;
+    while (count > 1) {
+        uint32_t half = count / 2;
+        r = r[half].lo <= id ? &r[half] : r;
+        count -= half;
+    }
+    return r->lo <= id && id <= r->hi;
+}
+
+// Check if a received message id should be reported to calling code
+static int __irqfunc
+filter_check(struct can2040 *cd, uint32_t id)
+{
+    if (id & CAN2040_ID_EFF) {
+        uint32_t range_count = cd->filter_range_count;
+        if (range_count)
+            return filter_check_ranges(cd->filter_ranges, range_count
+                                       , id & 0x1fffffff);
+        return filter_check_bank(cd->filter_ext, cd->filter_ext_count, id);
+    }
+    uint32_t *bitmap = cd->filter_std_bitmap;
+    if (bitmap) {
+        // Single lookup in a bitmap of accepted 11-bit ids
+        id &= 0x7ff;
+        return (bitmap[id / 32] >> (id % 32)) & 1;
+    }
+    return filter_check_bank(cd->filter_std, cd->filter_std_count, id);
+}
+
+
 /****************************************************************
  * Input state tracking
  ****************************************************************/
@@ -908,14 +1494,16 @@ enum {
 };
 
 // Reset any bits in the incoming parsing state
-static void
+static void __irqfunc
 data_state_clear_bits(struct can2040 *cd)
 {
+    cd->ts_bitpos -= cd->raw_bit_count;
+    cd->bus_busy_pos -= cd->raw_bit_count;
     cd->raw_bit_count = cd->unstuf.stuffed_bits = cd->unstuf.count_stuff = 0;
 }
 
 // Transition to the next parsing state
-static void
+static void __irqfunc
 data_state_go_next(struct can2040 *cd, uint32_t state, uint32_t num_bits)
 {
     cd->parse_state = state;
@@ -923,7 +1511,7 @@ data_state_go_next(struct can2040 *cd, uint32_t state, uint32_t num_bits)
 }
 
 // Transition to the MS_DISCARD state - drop all bits until 6 passive bits
-static void
+static void __irqfunc
 data_state_go_discard(struct can2040 *cd)
 {
     if (pio_rx_check_stall(cd)) {
@@ -940,15 +1528,18 @@ data_state_go_discard(struct can2040 *cd)
 }
 
 // Note a data parse error and transition to discard state
-static void
+static void __irqfunc
 data_state_go_error(struct can2040 *cd)
 {
     cd->stats.parse_error++;
+    if (cd->id_stats && cd->parse_state >= MS_DATA0
+        && cd->parse_state <= MS_EOF1)
+        idstats_note_error(cd);
     data_state_go_discard(cd);
 }
 
 // Received six dominant bits on the line
-static void
+static void __irqfunc
 data_state_line_error(struct can2040 *cd)
 {
     if (cd->parse_state == MS_DISCARD)
@@ -958,7 +1549,7 @@ data_state_line_error(struct can2040 *cd)
 }
 
 // Received six unexpected passive bits on the line
-static void
+static void __irqfunc
 data_state_line_passive(struct can2040 *cd)
 {
     if (cd->parse_state != MS_DISCARD && cd->parse_state != MS_START) {
@@ -979,6 +1570,13 @@ data_state_line_passive(struct can2040 *cd)
 
     // Look for sof after 10 passive bits (most "PIO sync" will produce)
     if (!(dom_bits & 0x3ff)) {
+        // Bus was busy until the last dominant bit (and the 8 bit
+        // delimiter and 3 bit intermission that follow it)
+        uint32_t passive = 10;
+        while (!(dom_bits & (1 << passive)))
+            passive++;
+        uint32_t pos = cd->raw_bit_count - cd->unstuf.count_stuff;
+        report_note_bus_idle(cd, pos - passive + 11);
         data_state_go_next(cd, MS_START, 1);
         return;
     }
@@ -987,7 +1585,7 @@ data_state_line_passive(struct can2040 *cd)
 }
 
 // Transition to MS_CRC state - await 16 bits of crc
-static void
+static void __irqfunc
 data_state_go_crc(struct can2040 *cd)
 {
     cd->parse_crc &= 0x7fff;
@@ -1008,7 +1606,7 @@ data_state_go_crc(struct can2040 *cd)
 }
 
 // Transition to MS_DATA0 state (if applicable) - await data bits
-static void
+static void __irqfunc
 data_state_go_data(struct can2040 *cd, uint32_t id, uint32_t data)
 {
     if (data & (0x03 << 4)) {
@@ -1016,14 +1614,17 @@ data_state_go_data(struct can2040 *cd, uint32_t id, uint32_t data)
         data_state_go_discard(cd);
         return;
     }
-    cd->parse_msg.data32[0] = cd->parse_msg.data32[1] = 0;
+    struct can2040_msg *pm = report_get_parse_slot(cd);
+    cd->parse_slot = pm;
+    pm->data32[0] = pm->data32[1] = 0;
     uint32_t dlc = data & 0x0f;
-    cd->parse_msg.dlc = dlc;
+    pm->dlc = dlc;
     if (data & (1 << 6)) {
         dlc = 0;
         id |= CAN2040_ID_RTR;
     }
-    cd->parse_msg.id = id;
+    pm->id = id;
+    cd->parse_accept = filter_check(cd, id);
     if (dlc)
         data_state_go_next(cd, MS_DATA0, dlc >= 4 ? 32 : dlc * 8);
     else
@@ -1031,16 +1632,23 @@ data_state_go_data(struct can2040 *cd, uint32_t id, uint32_t data)
 }
 
 // Handle reception of first bit of header (after start-of-frame (SOF))
-static void
+static void __irqfunc
 data_state_update_start(struct can2040 *cd, uint32_t data)
 {
     cd->parse_msg.id = data;
+    // Note raw bit position of the sof (for timestamps and bus load)
+    uint32_t sof_pos = cd->raw_bit_count - cd->unstuf.count_stuff - 2;
+    cd->parse_sof_pos = sof_pos;
+    if (!cd->bus_busy) {
+        cd->bus_busy = 1;
+        cd->bus_busy_pos = sof_pos;
+    }
     report_note_message_start(cd);
     data_state_go_next(cd, MS_HEADER, 17);
 }
 
 // Handle reception of next 17 header bits
-static void
+static void __irqfunc
 data_state_update_header(struct can2040 *cd, uint32_t data)
 {
     data |= cd->parse_msg.id << 17;
@@ -1055,7 +1663,7 @@ data_state_update_header(struct can2040 *cd, uint32_t data)
 }
 
 // Handle reception of additional 20 bits of "extended header"
-static void
+static void __irqfunc
 data_state_update_ext_header(struct can2040 *cd, uint32_t data)
 {
     uint32_t hdr1 = cd->parse_msg.id;
@@ -1067,12 +1675,13 @@ data_state_update_ext_header(struct can2040 *cd, uint32_t data)
 }
 
 // Handle reception of first 1-4 bytes of data content
-static void
+static void __irqfunc
 data_state_update_data0(struct can2040 *cd, uint32_t data)
 {
-    uint32_t dlc = cd->parse_msg.dlc, bits = dlc >= 4 ? 32 : dlc * 8;
+    struct can2040_msg *pm = cd->parse_slot;
+    uint32_t dlc = pm->dlc, bits = dlc >= 4 ? 32 : dlc * 8;
     cd->parse_crc = crc_bytes(cd->parse_crc, data, dlc);
-    cd->parse_msg.data32[0] = __builtin_bswap32(data << (32 - bits));
+    pm->data32[0] = __builtin_bswap32(data << (32 - bits));
     if (dlc > 4)
         data_state_go_next(cd, MS_DATA1, dlc >= 8 ? 32 : (dlc - 4) * 8);
     else
@@ -1080,17 +1689,18 @@ data_state_update_data0(struct can2040 *cd, uint32_t data)
 }
 
 // Handle reception of bytes 5-8 of data content
-static void
+static void __irqfunc
 data_state_update_data1(struct can2040 *cd, uint32_t data)
 {
-    uint32_t dlc = cd->parse_msg.dlc, bits = dlc >= 8 ? 32 : (dlc - 4) * 8;
+    struct can2040_msg *pm = cd->parse_slot;
+    uint32_t dlc = pm->dlc, bits = dlc >= 8 ? 32 : (dlc - 4) * 8;
     cd->parse_crc = crc_bytes(cd->parse_crc, data, dlc - 4);
-    cd->parse_msg.data32[1] = __builtin_bswap32(data << (32 - bits));
+    pm->data32[1] = __builtin_bswap32(data << (32 - bits));
     data_state_go_crc(cd);
 }
 
 // Handle reception of 16 bits of message CRC (15 crc bits + crc delimiter)
-static void
+static void __irqfunc
 data_state_update_crc(struct can2040 *cd, uint32_t data)
 {
     if (((cd->parse_crc << 1) | 1) != data) {
@@ -1104,7 +1714,7 @@ data_state_update_crc(struct can2040 *cd, uint32_t data)
 }
 
 // Handle reception of 2 bits of ack phase (ack, ack delimiter)
-static void
+static void __irqfunc
 data_state_update_ack(struct can2040 *cd, uint32_t data)
 {
     if (data != 0x01) {
@@ -1120,7 +1730,7 @@ data_state_update_ack(struct can2040 *cd, uint32_t data)
 }
 
 // Handle reception of first four end-of-frame (EOF) bits
-static void
+static void __irqfunc
 data_state_update_eof0(struct can2040 *cd, uint32_t data)
 {
     if (data != 0x0f || pio_rx_check_stall(cd)) {
@@ -1132,7 +1742,7 @@ data_state_update_eof0(struct can2040 *cd, uint32_t data)
 }
 
 // Handle reception of end-of-frame (EOF) bits 5-7 and first two IFS bits
-static void
+static void __irqfunc
 data_state_update_eof1(struct can2040 *cd, uint32_t data)
 {
     if (data == 0x1f) {
@@ -1149,14 +1759,14 @@ data_state_update_eof1(struct can2040 *cd, uint32_t data)
 }
 
 // Handle data received while in MS_DISCARD state
-static void
+static void __irqfunc
 data_state_update_discard(struct can2040 *cd, uint32_t data)
 {
     data_state_go_discard(cd);
 }
 
 // Update parsing state after reading the bits of the current field
-static void
+static void __irqfunc
 data_state_update(struct can2040 *cd, uint32_t data)
 {
     switch (cd->parse_state) {
@@ -1178,12 +1788,12 @@ data_state_update(struct can2040 *cd, uint32_t data)
  * Input processing
  ****************************************************************/
 
-// Process incoming data from PIO "rx" state machine
-static void
-process_rx(struct can2040 *cd, uint32_t rx_data)
+// Process 'count' bits (up to PIO_RX_WAKE_BITS) of incoming data
+static void __irqfunc
+process_rx_bits(struct can2040 *cd, uint32_t rx_data, uint32_t count)
 {
-    unstuf_add_bits(&cd->unstuf, rx_data, PIO_RX_WAKE_BITS);
-    cd->raw_bit_count += PIO_RX_WAKE_BITS;
+    unstuf_add_bits(&cd->unstuf, rx_data, count);
+    cd->raw_bit_count += count;
 
     // undo bit stuffing
     for (;;) {
@@ -1205,12 +1815,100 @@ process_rx(struct can2040 *cd, uint32_t rx_data)
     }
 }
 
+// Process 'count' bits of incoming data (most significant bit first)
+static void __irqfunc
+process_rx_data(struct can2040 *cd, uint32_t rx_data, uint32_t count)
+{
+    for (;;) {
+        uint32_t bits = count > PIO_RX_WAKE_BITS ? PIO_RX_WAKE_BITS : count;
+        count -= bits;
+        uint32_t raw_bit_count = cd->raw_bit_count + bits;
+        process_rx_bits(cd, rx_data >> count, bits);
+        if (likely(!count))
+            break;
+        if (cd->raw_bit_count != raw_bit_count)
+            // PIO state was reset - remaining bits are stale
+            break;
+    }
+}
+
+// Process incoming data from PIO "rx" state machine
+static void __irqfunc
+process_rx(struct can2040 *cd, uint32_t rx_data)
+{
+    // Each fifo entry contains 10, 20, or 30 bits (see can2040_rx_wake_config)
+    process_rx_data(cd, rx_data, cd->rx_wake_bits);
+}
+
+// Process incoming data that dma copied from the PIO "rx" fifo to the rx ring
+static uint32_t __irqfunc
+process_rx_dma(struct can2040 *cd)
+{
+    uint32_t push_pos = dma_rx_check_restart(cd, dma_rx_get_push_pos(cd));
+    uint32_t pending = push_pos - cd->rx_dma_pull_pos;
+    if (unlikely(pending >= cd->rx_dma_size)) {
+        // CPU couldn't keep up for some read data - must reset pio state
+        data_state_clear_bits(cd);
+        pio_sm_setup(cd);
+        report_callback_error(cd, 0);
+        data_state_go_discard(cd);
+        return 0;
+    }
+    uint32_t i;
+    for (i=0; i<pending; i++) {
+        uint32_t pull_pos = cd->rx_dma_pull_pos;
+        cd->rx_dma_pull_pos = pull_pos + 1;
+        process_rx(cd, dma_rx_read(cd, pull_pos));
+        if (cd->rx_dma_pull_pos != pull_pos + 1)
+            // PIO state was reset - remaining entries are stale
+            break;
+    }
+    return pending;
+}
+
+// Process bits still held in PIO "rx" isr once the line is idle
+static void __irqfunc
+process_rx_idle(struct can2040 *cd)
+{
+    if (cd->rx_wake_bits == PIO_RX_WAKE_BITS)
+        // Fifo always has enough bits to check the ack and eof
+        return;
+    uint32_t rx_data;
+    int count = pio_rx_flush(cd, cd->raw_bit_count, &rx_data);
+    if (count > 0) {
+        process_rx_data(cd, rx_data, count);
+    } else if (count < 0) {
+        // Unable to determine bit position - must reset pio state
+        data_state_clear_bits(cd);
+        pio_sm_setup(cd);
+        report_callback_error(cd, 0);
+        data_state_go_discard(cd);
+    }
+}
+
 // Main API irq notification function
-void
+void __irqfunc
 can2040_pio_irq_handler(struct can2040 *cd)
 {
-    pio_hw_t *pio_hw = cd->pio_hw;
+    pio_hw_t *pio_hw = (pio_hw_t *)cd->pio_hw;
     uint32_t ints = pio_hw->ints0;
+    if (cd->ts_bit_time)
+        ts_note_irq(cd);
+    if (cd->rx_dma_ring) {
+        // Fifo is drained by dma - process rx ring until fifo and ring empty
+        for (;;) {
+            int running = dma_rx_is_running(cd);
+            uint32_t pending = process_rx_dma(cd);
+            ints = pio_hw->ints0;
+            if (pending)
+                continue;
+            if (!(ints & SI_RX_DATA))
+                break;
+            if (!running && !dma_rx_is_running(cd))
+                // Dma channel stopped (and ring is empty) - read fifo below
+                break;
+        }
+    }
     while (likely(ints & SI_RX_DATA)) {
         uint32_t rx_data = pio_hw->rxf[1];
         process_rx(cd, rx_data);
@@ -1225,58 +1923,202 @@ can2040_pio_irq_handler(struct can2040 *cd)
     else if (ints & SI_MATCHED)
         // Transmit message completed successfully
         report_line_matched(cd);
-    else if (ints & SI_MAYTX)
+    else if (ints & SI_MAYTX) {
         // Bus is idle, but not all bits may have been flushed yet
+        process_rx_idle(cd);
         report_line_maytx(cd);
-    else if (ints & SI_TXPENDING)
+    } else if (ints & SI_TXPENDING)
         // Schedule a transmit
         report_line_txpending(cd);
 }
 
 
 /****************************************************************
- * Transmit queuing
+ * Deferred callbacks
  ****************************************************************/
 
-// API function to check if transmit space available
+// API function to check if deferred callbacks are pending
 int
-can2040_check_transmit(struct can2040 *cd)
+can2040_check_process(struct can2040 *cd)
 {
-    uint32_t tx_pull_pos = readl(&cd->tx_pull_pos);
-    uint32_t tx_push_pos = cd->tx_push_pos;
-    uint32_t pending = tx_push_pos - tx_pull_pos;
-    return pending < ARRAY_SIZE(cd->tx_queue);
+    uint32_t defer_push_pos = readl(&cd->defer_push_pos);
+    uint32_t defer_lost = readl(&cd->defer_lost);
+    return (defer_push_pos != cd->defer_pull_pos
+            || defer_lost != cd->defer_lost_reported);
 }
 
-// API function to transmit a message
+// API function to invoke callbacks deferred by the irq handler
+void
+can2040_process(struct can2040 *cd)
+{
+    for (;;) {
+        uint32_t defer_lost = readl(&cd->defer_lost);
+        if (defer_lost != cd->defer_lost_reported) {
+            // Irq handler found the queue full - report an error
+            cd->defer_lost_reported = defer_lost;
+            struct can2040_msg_ts msg = {};
+            if (cd->rx_cb)
+                cd->rx_cb(cd, CAN2040_NOTIFY_ERROR, &msg.msg);
+        }
+        uint32_t defer_pull_pos = cd->defer_pull_pos;
+        if (defer_pull_pos == readl(&cd->defer_push_pos))
+            return;
+        __DMB();
+        uint32_t pos = defer_pull_pos & (cd->defer_queue_size - 1);
+        struct can2040_notification *qn = &cd->defer_queue[pos];
+        if (cd->rx_cb)
+            cd->rx_cb(cd, qn->notify, &qn->msg.msg);
+        __DMB();
+        writel(&cd->defer_pull_pos, defer_pull_pos + 1);
+    }
+}
+
+
+/****************************************************************
+ * Receive queue
+ ****************************************************************/
+
+// API function to return the oldest message in the rx queue
+struct can2040_msg *
+can2040_rx_peek(struct can2040 *cd)
+{
+    uint32_t rx_pull_pos = cd->rx_pull_pos;
+    if (rx_pull_pos == readl(&cd->rx_push_pos))
+        // Queue empty
+        return NULL;
+    __DMB();
+    return &cd->rx_queue[rx_pull_pos & (cd->rx_queue_size - 1)];
+}
+
+// API function to remove the oldest message from the rx queue
 int
-can2040_transmit(struct can2040 *cd, struct can2040_msg *msg)
+can2040_rx_poll(struct can2040 *cd, struct can2040_msg *msg)
 {
-    uint32_t tx_pull_pos = readl(&cd->tx_pull_pos);
-    uint32_t tx_push_pos = cd->tx_push_pos;
-    uint32_t pending = tx_push_pos - tx_pull_pos;
-    if (pending >= ARRAY_SIZE(cd->tx_queue))
-        // Tx queue full
+    struct can2040_msg *qm = can2040_rx_peek(cd);
+    if (!qm)
         return -1;
+    if (msg)
+        memcpy(msg, qm, sizeof(*msg));
+    __DMB();
+    writel(&cd->rx_pull_pos, cd->rx_pull_pos + 1);
+    return 0;
+}
+
+
+/****************************************************************
+ * Transmit queuing
+ ****************************************************************/
 
-    // Copy msg into transmit queue
-    struct can2040_transmit *qt = &cd->tx_queue[tx_qpos(cd, tx_push_pos)];
+// Disable irqs and take the transmit spinlock (if multiple producers)
+static uint32_t
+tx_lock(struct can2040 *cd)
+{
+    io_rw_32 *spinlock = (io_rw_32 *)cd->tx_spinlock;
+    if (!spinlock)
+        return 0;
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    while (!*spinlock)
+        ;
+    __DMB();
+    return primask;
+}
+
+// Release the transmit spinlock and restore irqs
+static void
+tx_unlock(struct can2040 *cd, uint32_t primask)
+{
+    io_rw_32 *spinlock = (io_rw_32 *)cd->tx_spinlock;
+    if (!spinlock)
+        return;
+    __DMB();
+    *spinlock = 0;
+    __set_PRIMASK(primask);
+}
+
+// Reserve up to 'count' transmit queue entries starting at '*ppos'
+static uint32_t
+tx_queue_reserve(struct can2040 *cd, uint32_t count, uint32_t *ppos)
+{
+    if (cd->listen_only)
+        // Transmits not possible in listen-only mode
+        return 0;
+    uint32_t flags = tx_lock(cd);
+    uint32_t tx_reserve_pos = cd->tx_reserve_pos;
+    uint32_t pending = tx_reserve_pos - readl(&cd->tx_pull_pos);
+    uint32_t avail = cd->tx_queue_size - pending;
+    if (count > avail)
+        // Tx queue full
+        count = avail;
+    cd->tx_reserve_pos = tx_reserve_pos + count;
+    if (pending + count > cd->stats.tx_queue_max)
+        cd->stats.tx_queue_max = pending + count;
+    tx_unlock(cd, flags);
+    *ppos = tx_reserve_pos;
+    return count;
+}
+
+// Return the transmit queue entry at position 'pos'
+static struct can2040_transmit *
+tx_queue_entry(struct can2040 *cd, uint32_t pos)
+{
+    // Entries are used in the order they are freed by tx_note_sent()
+    __DMB();
+    return &cd->tx_queue[cd->tx_queue[tx_qpos(cd, pos)].free_slot];
+}
+
+// Submit 'count' entries previously obtained from tx_queue_reserve()
+static void
+tx_queue_submit(struct can2040 *cd, uint32_t count)
+{
+    // Ensure message contents are visible to the other ARM core
+    __DMB();
+
+    // Messages are submitted once all outstanding reservations complete
+    uint32_t flags = tx_lock(cd);
+    uint32_t tx_commit_count = cd->tx_commit_count + count;
+    uint32_t tx_reserve_pos = cd->tx_reserve_pos;
+    uint32_t do_wake = tx_reserve_pos - cd->tx_push_pos == tx_commit_count;
+    if (do_wake) {
+        writel(&cd->tx_push_pos, tx_reserve_pos);
+        tx_commit_count = 0;
+    }
+    cd->tx_commit_count = tx_commit_count;
+    tx_unlock(cd, flags);
+
+    if (do_wake) {
+        // Wakeup if in TS_IDLE state
+        __DMB();
+        pio_signal_set_txpending(cd);
+    }
+}
+
+// Return the number of data bytes in a transmit message
+static uint32_t
+tx_data_len(struct can2040_transmit *qt)
+{
+    if (qt->msg.id & CAN2040_ID_RTR)
+        return 0;
+    return qt->msg.dlc > 8 ? 8 : qt->msg.dlc;
+}
+
+// Store the id and dlc of 'msg' and bit stuff the message header
+static uint32_t
+tx_encode_header(struct can2040_transmit *qt, struct can2040_msg *msg
+                 , struct bitstuffer_s *bs)
+{
     uint32_t id = msg->id;
     if (id & CAN2040_ID_EFF)
         qt->msg.id = id & ~0x20000000;
     else
         qt->msg.id = id & (CAN2040_ID_RTR | 0x7ff);
     qt->msg.dlc = msg->dlc & 0x0f;
-    uint32_t data_len = qt->msg.dlc > 8 ? 8 : qt->msg.dlc;
-    if (qt->msg.id & CAN2040_ID_RTR)
-        data_len = 0;
     qt->msg.data32[0] = qt->msg.data32[1] = 0;
-    memcpy(qt->msg.data, msg->data, data_len);
 
     // Calculate crc and stuff bits
     uint32_t crc = 0;
     memset(qt->stuffed_data, 0, sizeof(qt->stuffed_data));
-    struct bitstuffer_s bs = { 1, 0, qt->stuffed_data };
+    *bs = (struct bitstuffer_s){ 1, 0, qt->stuffed_data };
     uint32_t edlc = qt->msg.dlc | (qt->msg.id & CAN2040_ID_RTR ? 0x40 : 0);
     if (qt->msg.id & CAN2040_ID_EFF) {
         // Extended header
@@ -1285,32 +2127,146 @@ can2040_transmit(struct can2040 *cd, struct can2040_msg *msg)
         uint32_t h2 = ((id & 0x1fff) << 7) | edlc;
         crc = crc_bytes(crc, h1 >> 4, 2);
         crc = crc_bytes(crc, ((h1 & 0x0f) << 20) | h2, 3);
-        bs_push(&bs, h1, 19);
-        bs_push(&bs, h2, 20);
+        bs_push(bs, h1, 19);
+        bs_push(bs, h2, 20);
     } else {
         // Standard header
         uint32_t hdr = ((qt->msg.id & 0x7ff) << 7) | edlc;
         crc = crc_bytes(crc, hdr, 3);
-        bs_push(&bs, hdr, 19);
+        bs_push(bs, hdr, 19);
     }
-    uint32_t i;
-    for (i=0; i<data_len; i++) {
+    return crc;
+}
+
+// Bit stuff the data and crc of a message (following its header)
+static void
+tx_encode_data(struct can2040_transmit *qt, uint32_t crc
+               , struct bitstuffer_s *bs)
+{
+    // Encode two data bytes at a time (fewer calls to bitstuff())
+    uint32_t i, data_len = tx_data_len(qt);
+    for (i=0; i + 1 < data_len; i+=2) {
+        uint32_t v = (qt->msg.data[i] << 8) | qt->msg.data[i + 1];
+        crc = crc_bytes(crc, v, 2);
+        bs_push(bs, v, 16);
+    }
+    if (i < data_len) {
         uint32_t v = qt->msg.data[i];
         crc = crc_byte(crc, v);
-        bs_push(&bs, v, 8);
+        bs_push(bs, v, 8);
     }
     qt->crc = crc & 0x7fff;
-    bs_push(&bs, qt->crc, 15);
-    bs_pushraw(&bs, 1, 1);
-    qt->stuffed_words = bs_finalize(&bs);
+    bs_push(bs, qt->crc, 15);
+    bs_pushraw(bs, 1, 1);
+    qt->stuffed_words = bs_finalize(bs);
+}
+
+// Copy 'msg' into a transmit queue entry and encode it
+static void
+tx_encode_msg(struct can2040_transmit *qt, struct can2040_msg *msg)
+{
+    struct bitstuffer_s bs;
+    uint32_t crc = tx_encode_header(qt, msg, &bs);
+    memcpy(qt->msg.data, msg->data, tx_data_len(qt));
+    tx_encode_data(qt, crc, &bs);
+}
 
-    // Submit
-    writel(&cd->tx_push_pos, tx_push_pos + 1);
+// API function to check if transmit space available
+int
+can2040_check_transmit(struct can2040 *cd)
+{
+    if (cd->listen_only)
+        return 0;
+    uint32_t tx_pull_pos = readl(&cd->tx_pull_pos);
+    uint32_t tx_reserve_pos = readl(&cd->tx_reserve_pos);
+    uint32_t pending = tx_reserve_pos - tx_pull_pos;
+    return pending < cd->tx_queue_size;
+}
 
-    // Wakeup if in TS_IDLE state
-    __DMB();
-    pio_signal_set_txpending(cd);
+// API function to transmit a message
+int
+can2040_transmit(struct can2040 *cd, struct can2040_msg *msg)
+{
+    uint32_t pos;
+    if (!tx_queue_reserve(cd, 1, &pos))
+        return -1;
 
+    // Copy msg into transmit queue and encode it
+    tx_encode_msg(tx_queue_entry(cd, pos), msg);
+
+    tx_queue_submit(cd, 1);
+    return 0;
+}
+
+// API function to transmit several messages
+int
+can2040_transmit_batch(struct can2040 *cd, struct can2040_msg *msgs
+                       , uint32_t count)
+{
+    uint32_t pos, i;
+    count = tx_queue_reserve(cd, count, &pos);
+    if (!count)
+        return 0;
+
+    // Encode all messages that fit and submit them together
+    for (i=0; i<count; i++)
+        tx_encode_msg(tx_queue_entry(cd, pos + i), &msgs[i]);
+
+    tx_queue_submit(cd, count);
+    return count;
+}
+
+// API function to pre-encode a message for can2040_transmit_prepared()
+void
+can2040_prepare(struct can2040_prepared *pm, struct can2040_msg *msg)
+{
+    // Encode header and note the crc and bit stuffing state after it
+    struct can2040_transmit *qt = &pm->tx;
+    struct bitstuffer_s bs;
+    uint32_t crc = tx_encode_header(qt, msg, &bs);
+    pm->hdr_crc = crc;
+    pm->hdr_bitpos = bs.bitpos;
+    pm->hdr_prev_stuffed = bs.prev_stuffed;
+    pm->hdr_data[0] = qt->stuffed_data[0];
+    pm->hdr_data[1] = qt->stuffed_data[1];
+
+    // Encode full message (for transmits that don't supply new data)
+    memcpy(qt->msg.data, msg->data, tx_data_len(qt));
+    tx_encode_data(qt, crc, &bs);
+}
+
+// API function to transmit a message prepared with can2040_prepare()
+int
+can2040_transmit_prepared(struct can2040 *cd, struct can2040_prepared *pm
+                          , const uint8_t *data)
+{
+    uint32_t pos;
+    if (!tx_queue_reserve(cd, 1, &pos))
+        return -1;
+
+    struct can2040_transmit *qt = tx_queue_entry(cd, pos);
+    if (!data) {
+        // Message is unchanged - just copy it
+        qt->msg = pm->tx.msg;
+        qt->crc = pm->tx.crc;
+        qt->stuffed_words = pm->tx.stuffed_words;
+        memcpy(qt->stuffed_data, pm->tx.stuffed_data
+               , sizeof(qt->stuffed_data));
+    } else {
+        // Restore state after header and encode the new data
+        qt->msg.id = pm->tx.msg.id;
+        qt->msg.dlc = pm->tx.msg.dlc;
+        qt->msg.data32[0] = qt->msg.data32[1] = 0;
+        memcpy(qt->msg.data, data, tx_data_len(qt));
+        qt->stuffed_data[0] = pm->hdr_data[0];
+        qt->stuffed_data[1] = pm->hdr_data[1];
+        qt->stuffed_data[2] = qt->stuffed_data[3] = qt->stuffed_data[4] = 0;
+        struct bitstuffer_s bs = { pm->hdr_prev_stuffed, pm->hdr_bitpos
+                                   , qt->stuffed_data };
+        tx_encode_data(qt, pm->hdr_crc, &bs);
+    }
+
+    tx_queue_submit(cd, 1);
     return 0;
 }
 
@@ -1319,6 +2275,18 @@ can2040_transmit(struct can2040 *cd, struct can2040_msg *msg)
  * Setup
  ****************************************************************/
 
+// Set the transmit queue storage
+static void
+tx_queue_init(struct can2040 *cd, struct can2040_transmit *queue
+              , uint32_t count)
+{
+    uint32_t i;
+    for (i=0; i<count; i++)
+        queue[i].free_slot = i;
+    cd->tx_queue = queue;
+    cd->tx_queue_size = count;
+}
+
 // API function to initialize can2040 code
 void
 can2040_setup(struct can2040 *cd, uint32_t pio_num)
@@ -1326,6 +2294,49 @@ can2040_setup(struct can2040 *cd, uint32_t pio_num)
     memset(cd, 0, sizeof(*cd));
     cd->pio_num = !!pio_num;
     cd->pio_hw = cd->pio_num ? pio1_hw : pio0_hw;
+    cd->rx_wake_bits = PIO_RX_WAKE_BITS;
+    cd->parse_slot = &cd->parse_msg;
+    tx_queue_init(cd, cd->tx_queue_local, ARRAY_SIZE(cd->tx_queue_local));
+}
+
+// API function to configure the number of bits in each rx fifo entry
+int
+can2040_rx_wake_config(struct can2040 *cd, uint32_t rx_wake_bits)
+{
+    rx_wake_bits -= rx_wake_bits % PIO_RX_WAKE_BITS;
+    if (rx_wake_bits < PIO_RX_WAKE_BITS)
+        rx_wake_bits = PIO_RX_WAKE_BITS;
+    if (rx_wake_bits > PIO_RX_WAKE_BITS * 3)
+        rx_wake_bits = PIO_RX_WAKE_BITS * 3;
+    if (rx_wake_bits > PIO_RX_WAKE_BITS && !cd->listen_only)
+        // Ack injection requires the crc position from a 10 bit entry
+        return -1;
+    cd->rx_wake_bits = rx_wake_bits;
+    return 0;
+}
+
+// API function to configure a dma channel to copy rx fifo data to a ring
+void
+can2040_rx_dma_config(struct can2040 *cd, uint32_t dma_chan
+                      , uint32_t *rx_ring, uint32_t ring_size)
+{
+    // Ring size must be a power of two within the dma address wrap range
+    while (ring_size & (ring_size - 1))
+        ring_size &= ring_size - 1;
+    if (ring_size > DMA_RX_MAX_RING)
+        ring_size = DMA_RX_MAX_RING;
+    // Ring must be aligned to its size (in bytes)
+    uint32_t align_mask = ring_size * sizeof(uint32_t) - 1;
+    if (dma_chan >= DMA_NUM_CHANNELS || ring_size < DMA_RX_MIN_RING
+        || (uint32_t)(uintptr_t)rx_ring & align_mask) {
+        // Invalid parameters - read the rx fifo directly
+        cd->rx_dma_ring = NULL;
+        cd->rx_dma_size = 0;
+        return;
+    }
+    cd->rx_dma_chan = dma_chan;
+    cd->rx_dma_ring = rx_ring;
+    cd->rx_dma_size = ring_size;
 }
 
 // API function to configure callback
@@ -1335,6 +2346,169 @@ can2040_callback_config(struct can2040 *cd, can2040_rx_cb rx_cb)
     cd->rx_cb = rx_cb;
 }
 
+// API function to configure receive acceptance filters
+void
+can2040_filter_config(struct can2040 *cd
+                      , struct can2040_filter *std_filters, uint32_t std_count
+                      , struct can2040_filter *ext_filters, uint32_t ext_count)
+{
+    cd->filter_std = std_filters;
+    cd->filter_std_count = std_filters ? std_count : 0;
+    cd->filter_ext = ext_filters;
+    cd->filter_ext_count = ext_filters ? ext_count : 0;
+}
+
+// API function to set (or replace) the 11-bit id acceptance bitmap
+void
+can2040_filter_bitmap_config(struct can2040 *cd, uint32_t *bitmap)
+{
+    // Make sure bitmap content is visible before the irq handler uses it
+    __DMB();
+    cd->filter_std_bitmap = bitmap;
+}
+
+// API helper function to mark an 11-bit id as accepted in a bitmap
+void
+can2040_filter_bitmap_add(uint32_t *bitmap, uint32_t id)
+{
+    id &= 0x7ff;
+    bitmap[id / 32] |= 1 << (id % 32);
+}
+
+// API function to set a table of accepted 29-bit id ranges
+void
+can2040_filter_range_config(struct can2040 *cd
+                            , struct can2040_filter_range *ranges
+                            , uint32_t count)
+{
+    cd->filter_ranges = ranges;
+    cd->filter_range_count = ranges ? count : 0;
+}
+
+// API helper function to sort and merge a table of 29-bit id ranges
+int
+can2040_filter_range_build(struct can2040_filter_range *ranges, uint32_t count)
+{
+    // Validate all entries (so an invalid table is left unmodified)
+    uint32_t i, j;
+    for (i=0; i<count; i++)
+        if (ranges[i].lo > ranges[i].hi || ranges[i].hi > 0x1fffffff)
+            return -1;
+
+    // Sort (insertion sort - tables are small)
+    for (i=0; i<count; i++) {
+        struct can2040_filter_range r = ranges[i];
+        for (j=i; j && ranges[j-1].lo > r.lo; j--)
+            ranges[j] = ranges[j-1];
+        ranges[j] = r;
+    }
+
+    // Merge overlapping and adjacent ranges
+    uint32_t merged = 0;
+    for (i=0; i<count; i++) {
+        struct can2040_filter_range r = ranges[i];
+        if (merged && r.lo <= ranges[merged - 1].hi + 1) {
+            if (r.hi > ranges[merged - 1].hi)
+                ranges[merged - 1].hi = r.hi;
+            continue;
+        }
+        ranges[merged++] = r;
+    }
+    return merged;
+}
+
+// API function to queue received messages for can2040_rx_poll()
+void
+can2040_rx_queue_config(struct can2040 *cd, struct can2040_msg *queue
+                        , uint32_t count)
+{
+    // Queue size must be a power of two
+    while (count & (count - 1))
+        count &= count - 1;
+    cd->rx_queue = count ? queue : NULL;
+    cd->rx_queue_size = count;
+}
+
+// API function to provide a larger transmit queue
+void
+can2040_tx_queue_config(struct can2040 *cd, struct can2040_transmit *queue
+                        , uint32_t count)
+{
+    // Queue slots are tracked in 16 bit fields
+    if (count > 65536)
+        count = 65536;
+    // Queue size must be a power of two
+    while (count & (count - 1))
+        count &= count - 1;
+    if (!count) {
+        queue = cd->tx_queue_local;
+        count = ARRAY_SIZE(cd->tx_queue_local);
+    }
+    tx_queue_init(cd, queue, count);
+}
+
+// API function to enable per-id statistics
+void
+can2040_id_stats_config(struct can2040 *cd, struct can2040_id_stats *table
+                        , uint32_t count)
+{
+    // Table size must be a power of two
+    while (count & (count - 1))
+        count &= count - 1;
+    if (count)
+        memset(table, 0, count * sizeof(*table));
+    cd->id_stats = count ? table : NULL;
+    cd->id_stats_size = count;
+}
+
+// API function to defer callbacks to can2040_process()
+void
+can2040_defer_config(struct can2040 *cd, uint32_t defer_flags
+                     , struct can2040_notification *queue, uint32_t count)
+{
+    // Queue size must be a power of two
+    while (count & (count - 1))
+        count &= count - 1;
+    if (!(defer_flags & CAN2040_DEFER_CALLBACK) || !count) {
+        defer_flags = count = 0;
+        queue = NULL;
+    }
+    cd->defer_flags = defer_flags;
+    cd->defer_queue = queue;
+    cd->defer_queue_size = count;
+}
+
+// API function to permit transmits from multiple irqs and ARM cores
+void
+can2040_tx_lock_config(struct can2040 *cd, uint32_t spinlock_num)
+{
+    cd->tx_spinlock = (uint32_t *)&sio_hw->spinlock[spinlock_num & 0x1f];
+}
+
+// API function to transmit queued messages in priority order
+void
+can2040_tx_priority_config(struct can2040 *cd, uint32_t tx_priority)
+{
+    cd->tx_priority = !!tx_priority;
+}
+
+// API function to select listen-only mode (never drive the CAN bus)
+void
+can2040_listen_only_config(struct can2040 *cd, uint32_t listen_only)
+{
+    cd->listen_only = !!listen_only;
+    if (!cd->listen_only)
+        // Larger rx fifo entries are only valid in listen-only mode
+        cd->rx_wake_bits = PIO_RX_WAKE_BITS;
+}
+
+// API function to enable message timestamps
+void
+can2040_timestamp_config(struct can2040 *cd, uint32_t enable)
+{
+    cd->ts_enable = !!enable;
+}
+
 // API function to start CANbus interface
 void
 can2040_start(struct can2040 *cd, uint32_t sys_clock, uint32_t bitrate
@@ -1342,6 +2516,10 @@ can2040_start(struct can2040 *cd, uint32_t sys_clock, uint32_t bitrate
 {
     cd->gpio_rx = gpio_rx;
     cd->gpio_tx = gpio_tx;
+    cd->bitrate = bitrate;
+    if (cd->ts_enable)
+        // Microseconds per bit (in 16.16 fixed point)
+        cd->ts_bit_time = ((uint64_t)1000000 << 16) / bitrate;
     data_state_clear_bits(cd);
     pio_setup(cd, sys_clock, bitrate);
     data_state_go_discard(cd);
@@ -1353,6 +2531,8 @@ can2040_stop(struct can2040 *cd)
 {
     pio_irq_disable(cd);
     pio_sm_setup(cd);
+    if (cd->rx_dma_ring)
+        dma_rx_stop(cd);
 }
 
 // API function to access can2040 statistics
@@ -1367,3 +2547,58 @@ can2040_get_statistics(struct can2040 *cd, struct can2040_stats *stats)
         // Raced with irq handler update - retry copy
     }
 }
+
+// API function to access the statistics of one entry of the per-id table
+int
+can2040_get_id_statistics(struct can2040 *cd, uint32_t index
+                          , struct can2040_id_stats *stats)
+{
+    if (index >= cd->id_stats_size)
+        return -1;
+    struct can2040_id_stats *is = &cd->id_stats[index];
+    for (;;) {
+        memcpy(stats, is, sizeof(*stats));
+        if (memcmp(stats, is, sizeof(*stats)) == 0)
+            // Successfully copied data
+            break;
+        // Raced with irq handler update - retry copy
+    }
+    if (!stats->frames)
+        // Entry not in use
+        return -1;
+    return 0;
+}
+
+// API function to measure the bus load over a period of time
+int
+can2040_bus_load_update(struct can2040 *cd, struct can2040_bus_load *bl
+                        , uint32_t window_us)
+{
+    if (!cd->bitrate) {
+        // Not started yet - start the window after can2040_start()
+        bl->started = 0;
+        return 0;
+    }
+    struct can2040_stats stats;
+    can2040_get_statistics(cd, &stats);
+    uint32_t now = timer_hw->timerawl;
+    if (!bl->started) {
+        bl->started = 1;
+        bl->start_time = now;
+        bl->start_bits = stats.bus_bits;
+        bl->start_stuff = stats.stuff_bits;
+        return 0;
+    }
+    uint32_t elapsed = now - bl->start_time;
+    if (elapsed < window_us || !elapsed)
+        return 0;
+    uint32_t bits = stats.bus_bits - bl->start_bits;
+    uint32_t stuff = stats.stuff_bits - bl->start_stuff;
+    uint64_t bit_times = (uint64_t)elapsed * cd->bitrate;
+    bl->load = (uint64_t)bits * 1000000000 / bit_times;
+    bl->stuff_ratio = bits ? (uint64_t)stuff * 1000 / bits : 0;
+    bl->start_time = now;
+    bl->start_bits = stats.bus_bits;
+    bl->start_stuff = stats.stuff_bits;
+    return 1;
+}
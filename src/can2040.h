@@ -12,6 +12,11 @@ struct can2040_msg {
     };
 };
 
+struct can2040_msg_ts {
+    struct can2040_msg msg;
+    uint32_t sof_time, eof_time;
+};
+
 enum {
     CAN2040_ID_RTR = 1<<30,
     CAN2040_ID_EFF = 1<<31,
@@ -22,25 +27,102 @@ enum {
     CAN2040_NOTIFY_TX = 1<<21,
     CAN2040_NOTIFY_ERROR = 1<<23,
 };
+enum {
+    CAN2040_DEFER_CALLBACK = 1<<0,
+    CAN2040_DEFER_WAKE_SEV = 1<<1,
+};
+
 struct can2040;
+struct can2040_transmit;
+struct can2040_prepared;
+struct can2040_notification;
 typedef void (*can2040_rx_cb)(struct can2040 *cd, uint32_t notify
                               , struct can2040_msg *msg);
 
+struct can2040_filter {
+    uint32_t id, mask;
+};
+
+struct can2040_filter_range {
+    uint32_t lo, hi;
+};
+
+enum {
+    CAN2040_FILTER_BITMAP_WORDS = 2048 / 32,
+};
+
 struct can2040_stats {
     uint32_t rx_total, tx_total;
     uint32_t tx_attempt;
     uint32_t parse_error;
+    uint32_t rx_overrun;
+    uint32_t bus_bits, stuff_bits;
+    uint32_t id_stats_full;
+    uint32_t tx_queue_max;
+    uint32_t notify_dropped;
+};
+
+struct can2040_id_stats {
+    uint32_t id;
+    uint32_t frames, bytes, errors;
+    uint32_t last_time, min_interval, max_interval;
+};
+
+struct can2040_bus_load {
+    uint32_t load, stuff_ratio;
+    uint32_t started, start_time, start_bits, start_stuff;
 };
 
 void can2040_setup(struct can2040 *cd, uint32_t pio_num);
 void can2040_callback_config(struct can2040 *cd, can2040_rx_cb rx_cb);
+void can2040_defer_config(struct can2040 *cd, uint32_t defer_flags
+                          , struct can2040_notification *queue
+                          , uint32_t count);
+void can2040_tx_queue_config(struct can2040 *cd, struct can2040_transmit *queue
+                             , uint32_t count);
+void can2040_tx_priority_config(struct can2040 *cd, uint32_t tx_priority);
+void can2040_tx_lock_config(struct can2040 *cd, uint32_t spinlock_num);
+void can2040_listen_only_config(struct can2040 *cd, uint32_t listen_only);
+void can2040_timestamp_config(struct can2040 *cd, uint32_t enable);
+void can2040_id_stats_config(struct can2040 *cd, struct can2040_id_stats *table
+                             , uint32_t count);
+void can2040_rx_queue_config(struct can2040 *cd, struct can2040_msg *queue
+                             , uint32_t count);
+void can2040_filter_config(struct can2040 *cd
+                           , struct can2040_filter *std_filters
+                           , uint32_t std_count
+                           , struct can2040_filter *ext_filters
+                           , uint32_t ext_count);
+void can2040_filter_bitmap_config(struct can2040 *cd, uint32_t *bitmap);
+void can2040_filter_bitmap_add(uint32_t *bitmap, uint32_t id);
+void can2040_filter_range_config(struct can2040 *cd
+                                 , struct can2040_filter_range *ranges
+                                 , uint32_t count);
+int can2040_filter_range_build(struct can2040_filter_range *ranges
+                               , uint32_t count);
+int can2040_rx_wake_config(struct can2040 *cd, uint32_t rx_wake_bits);
+void can2040_rx_dma_config(struct can2040 *cd, uint32_t dma_chan
+                           , uint32_t *rx_ring, uint32_t ring_size);
 void can2040_start(struct can2040 *cd, uint32_t sys_clock, uint32_t bitrate
                    , uint32_t gpio_rx, uint32_t gpio_tx);
 void can2040_stop(struct can2040 *cd);
 void can2040_get_statistics(struct can2040 *cd, struct can2040_stats *stats);
+int can2040_get_id_statistics(struct can2040 *cd, uint32_t index
+                              , struct can2040_id_stats *stats);
+int can2040_bus_load_update(struct can2040 *cd, struct can2040_bus_load *bl
+                            , uint32_t window_us);
 void can2040_pio_irq_handler(struct can2040 *cd);
 int can2040_check_transmit(struct can2040 *cd);
 int can2040_transmit(struct can2040 *cd, struct can2040_msg *msg);
+int can2040_transmit_batch(struct can2040 *cd, struct can2040_msg *msgs
+                          , uint32_t count);
+void can2040_prepare(struct can2040_prepared *pm, struct can2040_msg *msg);
+int can2040_transmit_prepared(struct can2040 *cd, struct can2040_prepared *pm
+                              , const uint8_t *data);
+int can2040_rx_poll(struct can2040 *cd, struct can2040_msg *msg);
+struct can2040_msg *can2040_rx_peek(struct can2040 *cd);
+int can2040_check_process(struct can2040 *cd);
+void can2040_process(struct can2040 *cd);
 
 
 /****************************************************************
@@ -55,13 +137,27 @@ struct can2040_bitunstuffer {
 struct can2040_transmit {
     struct can2040_msg msg;
     uint32_t crc, stuffed_words, stuffed_data[5];
+    // Queue bookkeeping (internal to can2040)
+    uint32_t seq;
+    uint16_t free_slot, heap_slot;
+};
+
+struct can2040_prepared {
+    struct can2040_transmit tx;
+    uint32_t hdr_crc, hdr_bitpos, hdr_prev_stuffed, hdr_data[2];
+};
+
+struct can2040_notification {
+    uint32_t notify;
+    struct can2040_msg_ts msg;
 };
 
 struct can2040 {
     // Setup
     uint32_t pio_num;
     void *pio_hw;
-    uint32_t gpio_rx, gpio_tx;
+    uint32_t gpio_rx, gpio_tx, bitrate;
+    uint32_t rx_wake_bits, listen_only;
     can2040_rx_cb rx_cb;
     struct can2040_stats stats;
 
@@ -69,18 +165,56 @@ struct can2040 {
     struct can2040_bitunstuffer unstuf;
     uint32_t raw_bit_count;
 
+    // Rx dma ring (optional)
+    uint32_t *rx_dma_ring;
+    uint32_t rx_dma_chan, rx_dma_size, rx_dma_pull_pos;
+
     // Input data state
     uint32_t parse_state;
     uint32_t parse_crc, parse_crc_bits, parse_crc_pos;
-    struct can2040_msg parse_msg;
+    struct can2040_msg parse_msg, *parse_slot;
+    uint32_t parse_accept, parse_sof_pos;
+    uint32_t bus_busy, bus_busy_pos;
+
+    // Acceptance filtering
+    struct can2040_filter *filter_std, *filter_ext;
+    uint32_t filter_std_count, filter_ext_count;
+    uint32_t *filter_std_bitmap;
+    struct can2040_filter_range *filter_ranges;
+    uint32_t filter_range_count;
 
     // Reporting
     uint32_t report_state;
+    struct can2040_msg_ts report_msg;
+
+    // Per-id statistics
+    struct can2040_id_stats *id_stats;
+    uint32_t id_stats_size;
+
+    // Timestamps
+    uint32_t ts_enable, ts_bit_time;
+    uint32_t ts_time, ts_bitpos;
+
+    // Receive queue
+    struct can2040_msg *rx_queue;
+    uint32_t rx_queue_size;
+    uint32_t rx_pull_pos, rx_push_pos;
+
+    // Deferred callbacks
+    uint32_t defer_flags;
+    uint32_t defer_pull_pos, defer_push_pos;
+    uint32_t defer_lost, defer_lost_reported;
+    struct can2040_notification *defer_queue;
+    uint32_t defer_queue_size;
 
     // Transmits
-    uint32_t tx_state;
-    uint32_t tx_pull_pos, tx_push_pos;
-    struct can2040_transmit tx_queue[4];
+    uint32_t tx_state, tx_priority;
+    uint32_t tx_pull_pos, tx_push_pos, tx_cur_slot;
+    uint32_t tx_heap_pos, tx_heap_count;
+    uint32_t tx_reserve_pos, tx_commit_count, *tx_spinlock;
+    struct can2040_transmit *tx_queue;
+    uint32_t tx_queue_size;
+    struct can2040_transmit tx_queue_local[4];
 };
 
 #endif // can2040.h
@@ -0,0 +1,315 @@
+// Measure the host cpu time used by the can2040 parser (and transmit queue)
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <stdio.h> // printf
+#include <stdlib.h> // rand
+#include <string.h> // memset
+#include <time.h> // clock_gettime
+#include "hostsim.h" // hostsim_encode_frame
+
+#define FRAMES 60 // Multiple of all rx wake sizes (no padding needed)
+#define TRIALS 7
+#define LOOPS 2000
+#define IDLE_BITS 13 // Idle bits between frames
+
+static uint32_t rx_count;
+
+static void
+rx_cb(struct can2040 *cd, uint32_t notify, struct can2040_msg *msg)
+{
+    if (notify == CAN2040_NOTIFY_RX)
+        rx_count++;
+}
+
+static double
+get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * .000000001;
+}
+
+// Optional extra configuration of the can2040 instance under test
+typedef void (*bench_setup_fn)(struct can2040 *cd);
+
+// Time the parsing of a stream of frames (repeating the 'msgs' list) -
+// 'accept' is the number of the FRAMES frames reported to the callback
+static void
+bench_setup(const char *name, struct can2040_msg *msgs, uint32_t msg_count
+            , uint32_t wake_bits, bench_setup_fn setup, uint32_t accept)
+{
+    static uint8_t bits[FRAMES * (IDLE_BITS + HS_MAX_FRAME_BITS) + 64];
+    static uint32_t words[sizeof(bits) / 10 + 1];
+    uint32_t count = 0, i;
+    for (i=0; i<FRAMES; i++) {
+        memset(&bits[count], 1, IDLE_BITS);
+        count += IDLE_BITS;
+        count += hostsim_encode_frame(&msgs[i % msg_count], &bits[count]);
+    }
+    uint32_t nwords = hostsim_pack_words(bits, count, wake_bits, words);
+
+    struct can2040 cd;
+    can2040_setup(&cd, 0);
+    can2040_callback_config(&cd, rx_cb);
+    if (wake_bits > 10) {
+        // Larger entries are only used in listen-only mode
+        can2040_listen_only_config(&cd, 1);
+        can2040_rx_wake_config(&cd, wake_bits);
+    }
+    if (setup)
+        setup(&cd);
+    hostsim_start(&cd);
+    hostsim_feed_words(&cd, words, nwords);
+    rx_count = 0;
+
+    // Use the fastest of several trials (to reduce noise from other tasks)
+    double best = 0.;
+    int t, l;
+    for (t=0; t<TRIALS; t++) {
+        double start = get_time();
+        for (l=0; l<LOOPS; l++)
+            hostsim_feed_words(&cd, words, nwords);
+        double elapsed = get_time() - start;
+        if (!t || elapsed < best)
+            best = elapsed;
+    }
+    uint32_t expect = TRIALS * LOOPS * accept;
+    double ns = best * 1000000000. / (LOOPS * FRAMES);
+    printf("%-12s wake=%u bits=%3u  %7.1f ns/frame  %10.0f frames/sec%s\n"
+           , name, wake_bits, count / FRAMES - IDLE_BITS, ns, 1000000000. / ns
+           , rx_count == expect ? "" : "  (PARSE ERROR)");
+}
+
+static void
+bench(const char *name, struct can2040_msg *msg, uint32_t wake_bits)
+{
+    bench_setup(name, msg, 1, wake_bits, NULL, FRAMES);
+}
+
+// Eight id/mask filters - only the last one matches 0x123
+static void
+setup_mask8(struct can2040 *cd)
+{
+    static struct can2040_filter filters[8];
+    uint32_t i;
+    for (i=0; i<8; i++) {
+        filters[i].id = 0x123 + (7 - i) * 0x80;
+        filters[i].mask = 0x7ff;
+    }
+    can2040_filter_config(cd, filters, 8, filters, 8);
+}
+
+// Application callback for a mixed id trace - keeps a copy of each
+// wanted message (checking the id itself if can2040 does not filter)
+#define APP_IDS 8
+#define APP_QUEUE 64
+static struct can2040_msg app_queue[APP_QUEUE];
+static uint32_t app_count, app_check_ids;
+
+static int
+app_id_wanted(uint32_t id)
+{
+    uint32_t i;
+    for (i=0; i<APP_IDS; i++)
+        if (id == 0x123 + (7 - i) * 0x80)
+            return 1;
+    return 0;
+}
+
+static void
+app_rx_cb(struct can2040 *cd, uint32_t notify, struct can2040_msg *msg)
+{
+    if (notify != CAN2040_NOTIFY_RX)
+        return;
+    rx_count++;
+    if (app_check_ids && !app_id_wanted(msg->id))
+        return;
+    memcpy(&app_queue[app_count++ % APP_QUEUE], msg, sizeof(*msg));
+}
+
+static void
+setup_app_all(struct can2040 *cd)
+{
+    can2040_callback_config(cd, app_rx_cb);
+    app_check_ids = 1;
+}
+
+static void
+setup_app_mask8(struct can2040 *cd)
+{
+    setup_mask8(cd);
+    can2040_callback_config(cd, app_rx_cb);
+    app_check_ids = 0;
+}
+
+// Compare filtering in the callback to filtering in can2040 on a trace
+// of standard ids where only one frame in six has a wanted id
+static void
+bench_trace(void)
+{
+    static struct can2040_msg trace[FRAMES];
+    uint32_t i, j, wanted = 0;
+    srand(1);
+    for (i=0; i<FRAMES; i++) {
+        struct can2040_msg *m = &trace[i];
+        if (i % 6 == 0) {
+            m->id = 0x123 + (wanted++ % APP_IDS) * 0x80;
+        } else {
+            do {
+                m->id = rand() & 0x7ff;
+            } while (app_id_wanted(m->id));
+        }
+        m->dlc = rand() % 9;
+        for (j=0; j<8; j++)
+            m->data[j] = j < m->dlc ? rand() : 0;
+    }
+    bench_setup("trace all", trace, FRAMES, 10, setup_app_all, FRAMES);
+    bench_setup("trace mask8", trace, FRAMES, 10, setup_app_mask8, wanted);
+}
+
+// Extended id filters (each accepting a block of 0x800 ids)
+#define MAX_FILTERS 128
+static uint32_t filter_count;
+
+static void
+setup_ext_masks(struct can2040 *cd)
+{
+    static struct can2040_filter filters[MAX_FILTERS];
+    uint32_t i;
+    for (i=0; i<filter_count; i++) {
+        filters[i].id = (i * 0x1000) | CAN2040_ID_EFF;
+        filters[i].mask = 0x1ffff800;
+    }
+    can2040_filter_config(cd, NULL, 0, filters, filter_count);
+}
+
+static void
+setup_ext_ranges(struct can2040 *cd)
+{
+    static struct can2040_filter_range ranges[MAX_FILTERS];
+    uint32_t i;
+    for (i=0; i<filter_count; i++) {
+        ranges[i].lo = i * 0x1000;
+        ranges[i].hi = i * 0x1000 + 0x7ff;
+    }
+    can2040_filter_range_config(cd, ranges, filter_count);
+}
+
+// Compare id/mask filters to a range table (message matches last entry)
+static void
+bench_ext_filters(struct can2040_msg *msg, uint32_t count)
+{
+    char name[16];
+    filter_count = count;
+    msg->id = ((count - 1) * 0x1000 + 0x123) | CAN2040_ID_EFF;
+    snprintf(name, sizeof(name), "ext mask%u", count);
+    bench_setup(name, msg, 1, 10, setup_ext_masks, FRAMES);
+    snprintf(name, sizeof(name), "ext range%u", count);
+    bench_setup(name, msg, 1, 10, setup_ext_ranges, FRAMES);
+}
+
+// Transmit benchmark modes
+enum { TX_MSG, TX_PREPARED, TX_PREPARED_DATA, TX_BATCH4, TX_BATCH32 };
+
+#define TX_QUEUE 32
+
+// Time queueing messages for transmit (the queue is reset between rounds)
+static void
+bench_tx(const char *name, struct can2040_msg *msg, int mode)
+{
+    static struct can2040_transmit tx_queue[TX_QUEUE];
+    struct can2040_msg msgs[TX_QUEUE];
+    struct can2040_prepared pm;
+    can2040_prepare(&pm, msg);
+    int i;
+    for (i=0; i<TX_QUEUE; i++)
+        msgs[i] = *msg;
+    double best = 0.;
+    uint32_t queued = 0;
+    int t, l;
+    for (t=0; t<TRIALS; t++) {
+        double elapsed = 0.;
+        for (l=0; l<LOOPS; l++) {
+            struct can2040 cd;
+            can2040_setup(&cd, 0);
+            can2040_callback_config(&cd, rx_cb);
+            can2040_tx_queue_config(&cd, tx_queue, TX_QUEUE);
+            hostsim_start(&cd);
+            double start = get_time();
+            switch (mode) {
+            case TX_MSG:
+                for (i=0; i<TX_QUEUE; i++)
+                    queued += !can2040_transmit(&cd, msg);
+                break;
+            case TX_PREPARED:
+                for (i=0; i<TX_QUEUE; i++)
+                    queued += !can2040_transmit_prepared(&cd, &pm, NULL);
+                break;
+            case TX_PREPARED_DATA:
+                for (i=0; i<TX_QUEUE; i++)
+                    queued += !can2040_transmit_prepared(&cd, &pm
+                                                         , msg->data);
+                break;
+            case TX_BATCH4:
+                for (i=0; i<TX_QUEUE; i+=4)
+                    queued += can2040_transmit_batch(&cd, &msgs[i], 4);
+                break;
+            case TX_BATCH32:
+                queued += can2040_transmit_batch(&cd, msgs, TX_QUEUE);
+                break;
+            }
+            elapsed += get_time() - start;
+        }
+        if (!t || elapsed < best)
+            best = elapsed;
+    }
+    double ns = best * 1000000000. / (LOOPS * TX_QUEUE);
+    printf("%-12s tx queue        %7.1f ns/msg  %12.0f msgs/sec%s\n"
+           , name, ns, 1000000000. / ns
+           , queued == TRIALS * LOOPS * TX_QUEUE ? "" : "  (QUEUE ERROR)");
+}
+
+int
+main(int argc, char **argv)
+{
+    struct can2040_msg std0 = { .id = 0x000, .dlc = 8 };
+    struct can2040_msg std1 = { .id = 0x7ff, .dlc = 8 };
+    memset(std1.data, 0xff, 8);
+    struct can2040_msg stdmix = { .id = 0x123, .dlc = 8
+                                  , .data = { 0x12, 0x34, 0x56, 0x78
+                                              , 0x9a, 0xbc, 0xde, 0xf0 } };
+    struct can2040_msg stdalt = { .id = 0x555, .dlc = 8 };
+    memset(stdalt.data, 0x55, 8);
+    struct can2040_msg ext0 = { .id = CAN2040_ID_EFF, .dlc = 8 };
+    struct can2040_msg rtr = { .id = 0x555 | CAN2040_ID_RTR, .dlc = 0 };
+    uint32_t wake_bits;
+    for (wake_bits=10; wake_bits<=30; wake_bits+=10) {
+        bench("std8 zeros", &std0, wake_bits);
+        bench("std8 ones", &std1, wake_bits);
+        bench("std8 mixed", &stdmix, wake_bits);
+        bench("std8 alt", &stdalt, wake_bits);
+        bench("ext8 zeros", &ext0, wake_bits);
+        bench("std rtr", &rtr, wake_bits);
+    }
+
+    // Cost of the acceptance filters
+    bench_setup("no filter", &stdmix, 1, 10, NULL, FRAMES);
+    bench_setup("mask8 acc", &stdmix, 1, 10, setup_mask8, FRAMES);
+    struct can2040_msg stdrej = stdmix;
+    stdrej.id = 0x124;
+    bench_setup("mask8 rej", &stdrej, 1, 10, setup_mask8, 0);
+    bench_trace();
+    struct can2040_msg extmix = stdmix;
+    uint32_t count;
+    for (count=8; count<=MAX_FILTERS; count*=4)
+        bench_ext_filters(&extmix, count);
+
+    // Cost of queueing a message for transmit
+    bench_tx("transmit", &stdmix, TX_MSG);
+    bench_tx("prepared", &stdmix, TX_PREPARED);
+    bench_tx("prep+data", &stdmix, TX_PREPARED_DATA);
+    bench_tx("batch4", &stdmix, TX_BATCH4);
+    bench_tx("batch32", &stdmix, TX_BATCH32);
+    return 0;
+}
@@ -0,0 +1,116 @@
+// Stress the queues used when can2040 runs on a dedicated ARM core
+//
+// One thread acts as the dedicated core (the irq handler receiving and
+// transmitting frames) and the main thread acts as the application core
+// (calling can2040_transmit() and can2040_process()).
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <pthread.h> // pthread_create
+#include <sched.h> // sched_yield
+#include <stdio.h> // printf
+#include <string.h> // memset
+#include "hostsim.h" // hostsim_feed_frame
+
+#define NUM_MSGS 5000
+#define DEFER_SIZE 8
+
+static struct can2040 cd;
+static struct can2040_notification defer_queue[DEFER_SIZE];
+static uint32_t rx_next, tx_next, bad_count, error_count;
+static uint32_t notify_count, stop; // Written by application core
+
+// Contents of the message with a given sequence number
+static void
+fill_msg(struct can2040_msg *msg, uint32_t base_id, uint32_t seq)
+{
+    memset(msg, 0, sizeof(*msg));
+    msg->id = base_id + (seq & 0xff);
+    msg->dlc = 8;
+    msg->data32[0] = seq;
+    msg->data32[1] = ~seq;
+}
+
+static int
+check_msg(struct can2040_msg *msg, uint32_t base_id, uint32_t seq)
+{
+    struct can2040_msg ref;
+    fill_msg(&ref, base_id, seq);
+    return (msg->id != ref.id || msg->dlc != ref.dlc
+            || msg->data32[0] != ref.data32[0]
+            || msg->data32[1] != ref.data32[1]);
+}
+
+// Callback (run from can2040_process() on the application core)
+static void
+rx_cb(struct can2040 *cd, uint32_t notify, struct can2040_msg *msg)
+{
+    if (notify == CAN2040_NOTIFY_RX)
+        bad_count += check_msg(msg, 0x100, rx_next++);
+    else if (notify == CAN2040_NOTIFY_TX)
+        bad_count += check_msg(msg, 0x400, tx_next++);
+    else
+        error_count++;
+    __atomic_store_n(&notify_count, notify_count + 1, __ATOMIC_RELEASE);
+}
+
+// Dedicated core - receive frames and send queued transmits
+static void *
+irq_thread(void *arg)
+{
+    uint32_t rx_seq = 0, tx_seq = 0;
+    while ((rx_seq < NUM_MSGS || tx_seq < NUM_MSGS)
+           && !__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+        // Don't overflow the notification queue (a queue entry is only
+        // released after its callback returns)
+        uint32_t consumed = __atomic_load_n(&notify_count, __ATOMIC_ACQUIRE);
+        if (rx_seq + tx_seq - consumed >= DEFER_SIZE - 1) {
+            sched_yield();
+            continue;
+        }
+        struct can2040_msg msg;
+        if (rx_seq < NUM_MSGS && (rx_seq <= tx_seq || tx_seq >= NUM_MSGS)) {
+            fill_msg(&msg, 0x100, rx_seq++);
+            hostsim_feed_frame(&cd, &msg);
+        } else if (!hostsim_tx_bus_next(&cd, &msg)) {
+            tx_seq++;
+        } else {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+    can2040_setup(&cd, 0);
+    can2040_callback_config(&cd, rx_cb);
+    can2040_defer_config(&cd, CAN2040_DEFER_CALLBACK, defer_queue
+                         , DEFER_SIZE);
+    hostsim_start(&cd);
+    hostsim_dmb_yield(1);
+
+    pthread_t t;
+    pthread_create(&t, NULL, irq_thread, NULL);
+    uint32_t tx_seq = 0;
+    while ((rx_next < NUM_MSGS || tx_next < NUM_MSGS) && !error_count) {
+        if (can2040_check_process(&cd))
+            can2040_process(&cd);
+        if (tx_seq < NUM_MSGS && can2040_check_transmit(&cd)) {
+            struct can2040_msg msg;
+            fill_msg(&msg, 0x400, tx_seq);
+            if (can2040_transmit(&cd, &msg) == 0)
+                tx_seq++;
+        }
+    }
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    pthread_join(t, NULL);
+    hostsim_dmb_yield(0);
+
+    int bad = (bad_count || error_count || rx_next != NUM_MSGS
+               || tx_next != NUM_MSGS);
+    printf("dedicated core: rx=%u tx=%u bad=%u errors=%u %s\n"
+           , rx_next, tx_next, bad_count, error_count, bad ? "FAIL" : "ok");
+    return bad;
+}
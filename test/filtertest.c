@@ -0,0 +1,264 @@
+// Check the receive acceptance filters (can2040_filter_config,
+// can2040_filter_bitmap_config, and can2040_filter_range_config)
+//
+// Messages are fed to the parser and the ids reported to the rx
+// callback are compared against the ids the filters should accept.
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <stdio.h> // printf
+#include <string.h> // memset
+#include "hostsim.h" // hostsim_feed_frame
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+
+static struct can2040 cd;
+static uint32_t rx_count, tx_count, error_count, last_id;
+
+static void
+rx_cb(struct can2040 *cd, uint32_t notify, struct can2040_msg *msg)
+{
+    if (notify == CAN2040_NOTIFY_RX) {
+        rx_count++;
+        last_id = msg->id;
+    } else if (notify == CAN2040_NOTIFY_TX) {
+        tx_count++;
+    } else {
+        error_count++;
+    }
+}
+
+static void
+start(void)
+{
+    memset(&cd, 0, sizeof(cd));
+    can2040_setup(&cd, 0);
+    can2040_callback_config(&cd, rx_cb);
+}
+
+// Feed a message to the parser and check if it was reported
+static int
+check_id(uint32_t id, int accept)
+{
+    struct can2040_msg msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.id = id;
+    msg.dlc = id & CAN2040_ID_RTR ? 0 : 2;
+    struct can2040_stats stats;
+    can2040_get_statistics(&cd, &stats);
+    uint32_t prev_count = rx_count, prev_total = stats.rx_total;
+    uint32_t prev_errors = stats.parse_error;
+    hostsim_feed_frame(&cd, &msg);
+    can2040_get_statistics(&cd, &stats);
+    // Rejected messages are not reported and are not counted in rx_total
+    uint32_t got = rx_count - prev_count;
+    if (got != !!accept || stats.rx_total - prev_total != got
+        || stats.parse_error != prev_errors || (got && last_id != id)) {
+        printf("  id=0x%08x expected accept=%d got=%u\n", id, accept, got);
+        return 1;
+    }
+    return 0;
+}
+
+static int
+test_mask_filters(void)
+{
+    start();
+    static struct can2040_filter std_filters[] = {
+        { 0x120, 0x7f0 },                       // 0x120-0x12f (data or rtr)
+        { 0x300, 0x7ff | CAN2040_ID_RTR },      // 0x300 data frames only
+    };
+    static struct can2040_filter ext_filters[] = {
+        { 0x18fe0000 | CAN2040_ID_EFF, 0x1fff0000 },
+    };
+    can2040_filter_config(&cd, std_filters, 2, ext_filters, 1);
+    hostsim_start(&cd);
+
+    int bad = 0;
+    bad |= check_id(0x120, 1);
+    bad |= check_id(0x12f, 1);
+    bad |= check_id(0x12f | CAN2040_ID_RTR, 1);
+    bad |= check_id(0x11f, 0);
+    bad |= check_id(0x130, 0);
+    bad |= check_id(0x300, 1);
+    bad |= check_id(0x300 | CAN2040_ID_RTR, 0);
+    bad |= check_id(0x301, 0);
+    // Filters for one id type do not match the other id type
+    bad |= check_id(0x120 | CAN2040_ID_EFF, 0);
+    bad |= check_id(0x18fe1234 | CAN2040_ID_EFF, 1);
+    bad |= check_id(0x18fe1234 | CAN2040_ID_EFF | CAN2040_ID_RTR, 1);
+    bad |= check_id(0x18ff0000 | CAN2040_ID_EFF, 0);
+    bad |= check_id(0x08fe0000 | CAN2040_ID_EFF, 0);
+
+    // Filters do not apply to the tx notification of a local transmit
+    struct can2040_msg msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.id = 0x555;
+    if (can2040_transmit(&cd, &msg) || hostsim_tx_bus_next(&cd, &msg)
+        || tx_count != 1)
+        bad = 1;
+    bad |= check_id(0x555, 0);
+
+    // A zero count accepts all messages of that id type
+    start();
+    can2040_filter_config(&cd, std_filters, 0, ext_filters, 1);
+    hostsim_start(&cd);
+    bad |= check_id(0x555, 1);
+    bad |= check_id(0x555 | CAN2040_ID_EFF, 0);
+
+    bad |= error_count != 0;
+    printf("mask filters: %s\n", bad ? "FAIL" : "ok");
+    return bad;
+}
+
+static int
+test_bitmap_filter(void)
+{
+    start();
+    static uint32_t bitmap[CAN2040_FILTER_BITMAP_WORDS];
+    memset(bitmap, 0, sizeof(bitmap));
+    can2040_filter_bitmap_add(bitmap, 0x000);
+    can2040_filter_bitmap_add(bitmap, 0x01f);
+    can2040_filter_bitmap_add(bitmap, 0x020);
+    can2040_filter_bitmap_add(bitmap, 0x7ff);
+    // Only the low 11 bits of an id are used
+    can2040_filter_bitmap_add(bitmap, 0x234 | CAN2040_ID_RTR);
+    static struct can2040_filter std_filters[] = { { 0x400, 0x700 } };
+    static struct can2040_filter ext_filters[] = {
+        { 0x0000001f | CAN2040_ID_EFF, 0x1fffffff },
+    };
+    can2040_filter_config(&cd, std_filters, 1, ext_filters, 1);
+    can2040_filter_bitmap_config(&cd, bitmap);
+    hostsim_start(&cd);
+
+    int bad = 0;
+    bad |= check_id(0x000, 1);
+    bad |= check_id(0x001, 0);
+    bad |= check_id(0x01e, 0);
+    bad |= check_id(0x01f, 1);
+    bad |= check_id(0x020, 1);
+    bad |= check_id(0x021, 0);
+    bad |= check_id(0x7fe, 0);
+    bad |= check_id(0x7ff, 1);
+    bad |= check_id(0x234, 1);
+    // Data and remote frames share a bit
+    bad |= check_id(0x234 | CAN2040_ID_RTR, 1);
+    bad |= check_id(0x020 | CAN2040_ID_RTR, 1);
+    // The bitmap replaces the std id/mask filters
+    bad |= check_id(0x400, 0);
+    // The bitmap does not apply to extended ids - the ext filters do
+    bad |= check_id(0x0000001f | CAN2040_ID_EFF, 1);
+    bad |= check_id(0x00000020 | CAN2040_ID_EFF, 0);
+    bad |= check_id(0x0000001e | CAN2040_ID_EFF, 0);
+
+    // The bitmap may be replaced while running
+    static uint32_t bitmap2[CAN2040_FILTER_BITMAP_WORDS];
+    memset(bitmap2, 0, sizeof(bitmap2));
+    can2040_filter_bitmap_add(bitmap2, 0x001);
+    can2040_filter_bitmap_config(&cd, bitmap2);
+    bad |= check_id(0x000, 0);
+    bad |= check_id(0x001, 1);
+
+    // Disabling the bitmap restores the std id/mask filters
+    can2040_filter_bitmap_config(&cd, NULL);
+    bad |= check_id(0x400, 1);
+    bad |= check_id(0x4ff, 1);
+    bad |= check_id(0x000, 0);
+    bad |= check_id(0x0000001f | CAN2040_ID_EFF, 1);
+
+    // An empty bitmap rejects all standard ids
+    start();
+    memset(bitmap2, 0, sizeof(bitmap2));
+    can2040_filter_bitmap_config(&cd, bitmap2);
+    hostsim_start(&cd);
+    bad |= check_id(0x000, 0);
+    bad |= check_id(0x7ff, 0);
+    bad |= check_id(0x7ff | CAN2040_ID_EFF, 1);
+
+    bad |= error_count != 0;
+    printf("bitmap filter: %s\n", bad ? "FAIL" : "ok");
+    return bad;
+}
+
+#define EFF(id) ((id) | CAN2040_ID_EFF)
+
+static int
+test_range_filter(void)
+{
+    // Invalid tables are reported
+    struct can2040_filter_range ranges[8] = {
+        { 0x200, 0x100 },
+    };
+    int bad = can2040_filter_range_build(ranges, 1) >= 0;
+    ranges[0] = (struct can2040_filter_range){ 0x100, 0x20000000 };
+    bad |= can2040_filter_range_build(ranges, 1) >= 0;
+    // A table with a late invalid entry is left unmodified
+    ranges[0] = (struct can2040_filter_range){ 0x300, 0x3ff };
+    ranges[1] = (struct can2040_filter_range){ 0x100, 0x200 };
+    ranges[2] = (struct can2040_filter_range){ 0x20000000, 0x20000000 };
+    bad |= can2040_filter_range_build(ranges, 3) >= 0;
+    bad |= ranges[0].lo != 0x300 || ranges[1].lo != 0x100;
+    ranges[0] = (struct can2040_filter_range){ 0x100, 0x1fffffff };
+    bad |= can2040_filter_range_build(ranges, 1) != 1;
+    bad |= can2040_filter_range_build(ranges, 0) != 0;
+
+    // Overlapping, adjacent, contained, and duplicate ranges are merged
+    struct can2040_filter_range in[] = {
+        { 0x5000, 0x5fff }, { 0x100, 0x1ff }, { 0x1fffff00, 0x1fffffff },
+        { 0x180, 0x2ff },   // overlaps 0x100-0x1ff
+        { 0x300, 0x30f },   // adjacent to 0x180-0x2ff
+        { 0x5100, 0x51ff }, // contained in 0x5000-0x5fff
+        { 0x400, 0x400 }, { 0x400, 0x400 }, { 0x402, 0x402 },
+    };
+    static const struct can2040_filter_range out[] = {
+        { 0x100, 0x30f }, { 0x400, 0x400 }, { 0x402, 0x402 },
+        { 0x5000, 0x5fff }, { 0x1fffff00, 0x1fffffff },
+    };
+    int count = can2040_filter_range_build(in, ARRAY_SIZE(in));
+    bad |= count != ARRAY_SIZE(out) || memcmp(in, out, sizeof(out));
+
+    start();
+    static struct can2040_filter ext_filters[] = { { EFF(0x400), ~0 } };
+    can2040_filter_config(&cd, NULL, 0, ext_filters, 1);
+    can2040_filter_range_config(&cd, in, count);
+    hostsim_start(&cd);
+    static const uint32_t accept[] = {
+        0x100, 0x101, 0x1ff, 0x200, 0x2ff, 0x300, 0x30f, 0x400, 0x402,
+        0x5000, 0x5100, 0x5fff, 0x1fffff00, 0x1fffffff,
+    };
+    static const uint32_t reject[] = {
+        0x0, 0xff, 0x310, 0x3ff, 0x401, 0x403, 0x4fff, 0x6000,
+        0x1ffffeff,
+    };
+    uint32_t i;
+    for (i=0; i<ARRAY_SIZE(accept); i++)
+        bad |= check_id(EFF(accept[i]), 1);
+    for (i=0; i<ARRAY_SIZE(reject); i++)
+        bad |= check_id(EFF(reject[i]), 0);
+    // The range table replaces the ext id/mask filters
+    bad |= check_id(EFF(0x401) | CAN2040_ID_RTR, 0);
+    bad |= check_id(EFF(0x402) | CAN2040_ID_RTR, 1);
+    // Standard ids are not checked against the range table
+    bad |= check_id(0x050, 1);
+
+    // A single range
+    start();
+    can2040_filter_range_config(&cd, &in[1], 1);
+    hostsim_start(&cd);
+    bad |= check_id(EFF(0x3ff), 0);
+    bad |= check_id(EFF(0x400), 1);
+    bad |= check_id(EFF(0x401), 0);
+
+    bad |= error_count != 0;
+    printf("range filter: %s\n", bad ? "FAIL" : "ok");
+    return bad;
+}
+
+int
+main(int argc, char **argv)
+{
+    int bad = test_mask_filters();
+    bad |= test_bitmap_filter();
+    bad |= test_range_filter();
+    return bad;
+}
@@ -0,0 +1,339 @@
+// Helpers for running can2040.c on a host machine
+//
+// This file is compiled as C++ so that every register access made by
+// can2040.c is routed through hostsim_io_read() and hostsim_io_write()
+// (see include/hardware/address_mapped.h).
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <sched.h> // sched_yield
+#include "RP2040.h" // __DMB
+#include "hardware/structs/dma.h" // dma_hw
+#include "hardware/structs/iobank0.h" // iobank0_hw
+#include "hardware/structs/padsbank0.h" // padsbank0_hw
+#include "hardware/structs/pio.h" // pio0_hw
+#include "hardware/structs/resets.h" // resets_hw
+#include "hardware/structs/sio.h" // sio_hw
+#include "hardware/structs/timer.h" // timer_hw
+#include "hostsim.h" // hostsim_encode_frame
+
+extern "C" {
+
+// The can2040 code under test (with access to its internal functions)
+#include "can2040.c"
+
+
+/****************************************************************
+ * Register stand-ins
+ ****************************************************************/
+
+pio_hw_t hostsim_pio0, hostsim_pio1;
+dma_hw_t hostsim_dma;
+timer_hw_t hostsim_timer;
+resets_hw_t hostsim_resets;
+padsbank0_hw_t hostsim_padsbank0;
+iobank0_hw_t hostsim_iobank0;
+sio_hw_t hostsim_sio;
+
+
+/****************************************************************
+ * Barriers, irq disabling, and spinlocks
+ ****************************************************************/
+
+static int dmb_yield;
+
+// Yield the cpu at random barriers (to widen race windows in thread tests)
+void
+hostsim_dmb_yield(int enable)
+{
+    dmb_yield = enable;
+}
+
+void
+hostsim_dmb(void)
+{
+    __sync_synchronize();
+    static __thread uint32_t seed = 1;
+    if (dmb_yield) {
+        seed = seed * 1103515245 + 12345;
+        if (!((seed >> 16) % 5))
+            sched_yield();
+    }
+}
+
+// Each host thread stands in for a separate core (or for the irq
+// handler of a core that does nothing else), so disabling irqs only
+// records the primask - exclusion between threads comes from the
+// hardware spinlocks below.
+static __thread uint32_t primask;
+
+uint32_t
+hostsim_get_primask(void)
+{
+    return primask;
+}
+
+void
+hostsim_disable_irq(void)
+{
+    primask = 1;
+}
+
+void
+hostsim_set_primask(uint32_t val)
+{
+    primask = val;
+}
+
+static uint32_t spinlock_contended;
+
+// Return the hardware spinlock number of a register address (or a
+// value past the last spinlock if it is not a spinlock register)
+static uint32_t
+spinlock_num(const volatile void *addr)
+{
+    return ((uintptr_t)addr - (uintptr_t)hostsim_sio.spinlock) / 4;
+}
+
+// Reading a spinlock register claims the lock if it is free
+static uint32_t
+spinlock_claim(uint32_t lock)
+{
+    uint32_t *reg = (uint32_t *)&hostsim_sio.spinlock[lock];
+    if (!__sync_lock_test_and_set(reg, 1))
+        return 1 << lock;
+    // Held by another thread - let it make progress
+    __atomic_add_fetch(&spinlock_contended, 1, __ATOMIC_RELAXED);
+    if (dmb_yield)
+        sched_yield();
+    return 0;
+}
+
+// Writing a spinlock register releases the lock
+static void
+spinlock_release(uint32_t lock)
+{
+    __sync_lock_release((uint32_t *)&hostsim_sio.spinlock[lock]);
+}
+
+// Number of spinlock claims that found the lock already held
+uint32_t
+hostsim_spinlock_contended(void)
+{
+    return __atomic_load_n(&spinlock_contended, __ATOMIC_RELAXED);
+}
+
+
+/****************************************************************
+ * Register access
+ ****************************************************************/
+
+static hostsim_io_hook_fn io_hook;
+
+// Set a function to implement register side-effects
+void
+hostsim_io_hook_config(hostsim_io_hook_fn hook)
+{
+    io_hook = hook;
+}
+
+// Find the register block and offset of a register address
+static int
+io_lookup(const volatile void *addr, uint32_t *poffset)
+{
+    // Listed in HS_xxx order
+    static const struct {
+        const void *base;
+        uint32_t size;
+    } blocks[] = {
+        { &hostsim_pio0, sizeof(hostsim_pio0) },
+        { &hostsim_pio1, sizeof(hostsim_pio1) },
+        { &hostsim_dma, sizeof(hostsim_dma) },
+        { &hostsim_timer, sizeof(hostsim_timer) },
+        { &hostsim_resets, sizeof(hostsim_resets) },
+        { &hostsim_padsbank0, sizeof(hostsim_padsbank0) },
+        { &hostsim_iobank0, sizeof(hostsim_iobank0) },
+        { &hostsim_sio, sizeof(hostsim_sio) },
+    };
+    uintptr_t a = (uintptr_t)addr;
+    uint32_t i;
+    for (i=0; i<ARRAY_SIZE(blocks); i++) {
+        uintptr_t base = (uintptr_t)blocks[i].base;
+        if (a >= base && a < base + blocks[i].size) {
+            *poffset = a - base;
+            return i;
+        }
+    }
+    *poffset = 0;
+    return -1;
+}
+
+// Read a register
+uint32_t
+hostsim_io_read(const volatile void *addr)
+{
+    if (io_hook) {
+        uint32_t offset, val, dev = io_lookup(addr, &offset);
+        if (io_hook(dev, offset, 0, &val))
+            return val;
+    }
+    uint32_t lock = spinlock_num(addr);
+    if (lock < ARRAY_SIZE(hostsim_sio.spinlock))
+        return spinlock_claim(lock);
+    return *(const volatile uint32_t *)addr;
+}
+
+// Write a register
+void
+hostsim_io_write(volatile void *addr, uint32_t val)
+{
+    if (io_hook) {
+        uint32_t offset, dev = io_lookup(addr, &offset);
+        if (io_hook(dev, offset, 1, &val))
+            return;
+    }
+    volatile uint32_t *reg = (volatile uint32_t *)addr;
+    uint32_t lock = spinlock_num(addr);
+    if (lock < ARRAY_SIZE(hostsim_sio.spinlock))
+        spinlock_release(lock);
+    else if (addr == &hostsim_pio0.fdebug || addr == &hostsim_pio1.fdebug)
+        // Write one to clear
+        *reg &= ~val;
+    else if (addr == &hostsim_dma.abort)
+        // Abort completes immediately
+        *reg = 0;
+    else
+        *reg = val;
+}
+
+
+/****************************************************************
+ * Test helpers
+ ****************************************************************/
+
+// Size of 'struct can2040' (for callers that allocate it dynamically)
+uint32_t
+hostsim_sizeof_can2040(void)
+{
+    return sizeof(struct can2040);
+}
+
+// Sizes of API structs (for callers that mirror or allocate them)
+uint32_t
+hostsim_sizeof_stats(void)
+{
+    return sizeof(struct can2040_stats);
+}
+
+uint32_t
+hostsim_sizeof_transmit(void)
+{
+    return sizeof(struct can2040_transmit);
+}
+
+// Select the PIO "sync" machine "may transmit" signal timing
+void
+hostsim_pio_start_signal(struct can2040 *cd, uint32_t slow)
+{
+    if (slow)
+        pio_sync_slow_start_signal(cd);
+    else
+        pio_sync_normal_start_signal(cd);
+}
+
+// Arm PIO ack injection for a crc ending at the given rx bit position
+void
+hostsim_pio_inject_ack(struct can2040 *cd, uint32_t raw_bits
+                       , uint32_t rx_bit_pos)
+{
+    pio_tx_inject_ack(cd, pio_match_calc_key(raw_bits, rx_bit_pos));
+}
+
+// Start can2040 (125Mhz system clock, 1Mbit/s bus)
+void
+hostsim_start(struct can2040 *cd)
+{
+    can2040_start(cd, 125000000, 1000000, 4, 5);
+}
+
+// Generate the raw bits of a frame (sof to end of interframe space)
+uint32_t
+hostsim_encode_frame(struct can2040_msg *msg, uint8_t *bits)
+{
+    struct can2040_transmit qt;
+    struct bitstuffer_s bs;
+    uint32_t crc = tx_encode_header(&qt, msg, &bs);
+    memcpy(qt.msg.data, msg->data, tx_data_len(&qt));
+    tx_encode_data(&qt, crc, &bs);
+    uint32_t i, count = 0;
+    for (i=0; i<bs.bitpos; i++)
+        bits[count++] = (qt.stuffed_data[i / 32] >> (31 - i % 32)) & 1;
+    // Ack slot (dominant), ack delimiter, eof, and interframe space
+    bits[count++] = 0;
+    for (i=0; i<1+7+3; i++)
+        bits[count++] = 1;
+    return count;
+}
+
+// Pack raw bits into PIO rx fifo entries (padded with recessive bits)
+uint32_t
+hostsim_pack_words(const uint8_t *bits, uint32_t count, uint32_t wake_bits
+                   , uint32_t *words)
+{
+    uint32_t i, j, nwords = DIV_ROUND_UP(count, wake_bits);
+    for (i=0; i<nwords; i++) {
+        uint32_t w = 0;
+        for (j=0; j<wake_bits; j++) {
+            uint32_t pos = i * wake_bits + j;
+            w = (w << 1) | (pos < count ? bits[pos] : 1);
+        }
+        words[i] = w;
+    }
+    return nwords;
+}
+
+// Pass PIO rx fifo entries to the parser
+void
+hostsim_feed_words(struct can2040 *cd, const uint32_t *words, uint32_t count)
+{
+    uint32_t i;
+    for (i=0; i<count; i++)
+        process_rx(cd, words[i]);
+}
+
+// Pass an idle period followed by a frame to the parser
+void
+hostsim_feed_frame(struct can2040 *cd, struct can2040_msg *msg)
+{
+    uint8_t bits[11 + HS_MAX_FRAME_BITS];
+    uint32_t words[DIV_ROUND_UP(ARRAY_SIZE(bits), PIO_RX_WAKE_BITS)];
+    uint32_t count = 11;
+    memset(bits, 1, count);
+    count += hostsim_encode_frame(msg, &bits[count]);
+    count = hostsim_pack_words(bits, count, cd->rx_wake_bits, words);
+    hostsim_feed_words(cd, words, count);
+}
+
+// Act as the irq handler loading the next transmit into the PIO - the
+// message is then placed on the bus (and acked by another node)
+int
+hostsim_tx_bus_next(struct can2040 *cd, struct can2040_msg *msg)
+{
+    if (tx_schedule_transmit(cd) || cd->tx_state != TS_QUEUED)
+        return -1;
+    struct can2040_transmit *qt = &cd->tx_queue[cd->tx_cur_slot];
+    *msg = qt->msg;
+
+    // Check the encoded message matches what the PIO would transmit
+    struct can2040_transmit ref;
+    tx_encode_msg(&ref, msg);
+    if (ref.crc != qt->crc || ref.stuffed_words != qt->stuffed_words
+        || memcmp(ref.stuffed_data, qt->stuffed_data
+                  , qt->stuffed_words * sizeof(uint32_t)))
+        return -2;
+
+    hostsim_feed_frame(cd, msg);
+    return 0;
+}
+
+} // extern "C"
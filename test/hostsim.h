@@ -0,0 +1,48 @@
+#ifndef _HOSTSIM_H
+#define _HOSTSIM_H
+// Helpers for running can2040.c on a host machine
+
+#include <stdint.h> // uint32_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "can2040.h" // struct can2040
+
+// Register blocks reported to the io hook
+enum {
+    HS_PIO0, HS_PIO1, HS_DMA, HS_TIMER, HS_RESETS, HS_PADSBANK0, HS_IOBANK0,
+    HS_SIO,
+};
+
+// Register access hook - return non-zero if the access was handled
+typedef int (*hostsim_io_hook_fn)(uint32_t dev, uint32_t offset
+                                  , uint32_t is_write, uint32_t *val);
+
+// Maximum number of raw bits from hostsim_encode_frame()
+#define HS_MAX_FRAME_BITS 160
+
+void hostsim_io_hook_config(hostsim_io_hook_fn hook);
+void hostsim_dmb_yield(int enable);
+uint32_t hostsim_spinlock_contended(void);
+uint32_t hostsim_sizeof_can2040(void);
+uint32_t hostsim_sizeof_stats(void);
+uint32_t hostsim_sizeof_transmit(void);
+void hostsim_pio_start_signal(struct can2040 *cd, uint32_t slow);
+void hostsim_pio_inject_ack(struct can2040 *cd, uint32_t raw_bits
+                            , uint32_t rx_bit_pos);
+void hostsim_start(struct can2040 *cd);
+uint32_t hostsim_encode_frame(struct can2040_msg *msg, uint8_t *bits);
+uint32_t hostsim_pack_words(const uint8_t *bits, uint32_t count
+                            , uint32_t wake_bits, uint32_t *words);
+void hostsim_feed_words(struct can2040 *cd, const uint32_t *words
+                        , uint32_t count);
+void hostsim_feed_frame(struct can2040 *cd, struct can2040_msg *msg);
+int hostsim_tx_bus_next(struct can2040 *cd, struct can2040_msg *msg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // hostsim.h
@@ -0,0 +1,30 @@
+#ifndef _RP2040_H
+#define _RP2040_H
+// Host build stand-in for the rp2040 cmsis header
+
+#include "hardware/address_mapped.h" // hw_set_bits
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Memory barrier (see hostsim_dmb_yield() )
+extern void hostsim_dmb(void);
+#define __DMB() hostsim_dmb()
+
+#define __SEV() do { } while (0)
+
+// Each host thread acts as a separate core, so disabling irqs only
+// records the primask (see hostsim_disable_irq() )
+extern uint32_t hostsim_get_primask(void);
+extern void hostsim_disable_irq(void);
+extern void hostsim_set_primask(uint32_t primask);
+#define __get_PRIMASK() hostsim_get_primask()
+#define __disable_irq() hostsim_disable_irq()
+#define __set_PRIMASK(v) hostsim_set_primask(v)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // RP2040.h
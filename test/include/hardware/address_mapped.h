@@ -0,0 +1,49 @@
+#ifndef _HARDWARE_ADDRESS_MAPPED_H
+#define _HARDWARE_ADDRESS_MAPPED_H
+// Host build stand-in for the rp2040 sdk register types
+//
+// When compiled as C++ (as done for can2040.c in test/hostsim.c) each
+// register access is routed through hostsim_io_read() and
+// hostsim_io_write() so that the hardware side-effects can be simulated.
+// When compiled as C the registers are plain memory that a test may
+// access directly.
+
+#include <stdint.h> // uint32_t
+
+#ifdef __cplusplus
+
+#define HOSTSIM_EXTERN extern "C"
+
+extern "C" uint32_t hostsim_io_read(const volatile void *addr);
+extern "C" void hostsim_io_write(volatile void *addr, uint32_t val);
+
+struct io_reg32 {
+    uint32_t val;
+    operator uint32_t() const volatile { return hostsim_io_read(this); }
+    void operator=(uint32_t v) volatile { hostsim_io_write(this, v); }
+};
+typedef io_reg32 io_rw_32;
+
+static inline void hw_set_bits(volatile io_rw_32 *addr, uint32_t mask) {
+    *addr = *addr | mask;
+}
+static inline void hw_clear_bits(volatile io_rw_32 *addr, uint32_t mask) {
+    *addr = *addr & ~mask;
+}
+
+#else // __cplusplus
+
+#define HOSTSIM_EXTERN extern
+
+typedef volatile uint32_t io_rw_32;
+
+static inline void hw_set_bits(io_rw_32 *addr, uint32_t mask) {
+    *addr |= mask;
+}
+static inline void hw_clear_bits(io_rw_32 *addr, uint32_t mask) {
+    *addr &= ~mask;
+}
+
+#endif // __cplusplus
+
+#endif // address_mapped.h
@@ -0,0 +1,10 @@
+#ifndef _HARDWARE_REGS_DREQ_H
+#define _HARDWARE_REGS_DREQ_H
+// Host build stand-in for the rp2040 sdk dreq definitions
+
+#define DREQ_PIO0_RX0 4
+#define DREQ_PIO0_RX1 5
+#define DREQ_PIO1_RX0 12
+#define DREQ_PIO1_RX1 13
+
+#endif // dreq.h
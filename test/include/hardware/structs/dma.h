@@ -0,0 +1,40 @@
+#ifndef _HARDWARE_STRUCTS_DMA_H
+#define _HARDWARE_STRUCTS_DMA_H
+// Host build stand-in for the rp2040 sdk dma register definitions
+
+#include "hardware/address_mapped.h" // io_rw_32
+
+typedef struct {
+    io_rw_32 read_addr, write_addr, transfer_count, ctrl_trig;
+    io_rw_32 al1_ctrl, al1_read_addr, al1_write_addr, al1_transfer_count_trig;
+    io_rw_32 al2_ctrl, al2_transfer_count, al2_read_addr, al2_write_addr_trig;
+    io_rw_32 al3_ctrl, al3_write_addr, al3_transfer_count, al3_read_addr_trig;
+} dma_channel_hw_t;
+
+typedef struct {
+    dma_channel_hw_t ch[12];
+    uint32_t _pad0[64];
+    io_rw_32 intr, inte0, intf0, ints0;
+    uint32_t _pad1[4];
+    io_rw_32 timer[4], multi_channel_trigger, sniff_ctrl, sniff_data;
+    uint32_t _pad2[1];
+    io_rw_32 fifo_levels, abort;
+} dma_hw_t;
+
+HOSTSIM_EXTERN dma_hw_t hostsim_dma;
+#define dma_hw (&hostsim_dma)
+
+#define DMA_CH0_CTRL_TRIG_EN_BITS 0x00000001
+#define DMA_CH0_CTRL_TRIG_HIGH_PRIORITY_BITS 0x00000002
+#define DMA_CH0_CTRL_TRIG_DATA_SIZE_LSB 2
+#define DMA_CH0_CTRL_TRIG_DATA_SIZE_VALUE_SIZE_WORD 0x2
+#define DMA_CH0_CTRL_TRIG_INCR_READ_BITS 0x00000010
+#define DMA_CH0_CTRL_TRIG_INCR_WRITE_BITS 0x00000020
+#define DMA_CH0_CTRL_TRIG_RING_SIZE_LSB 6
+#define DMA_CH0_CTRL_TRIG_RING_SEL_BITS 0x00000400
+#define DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB 11
+#define DMA_CH0_CTRL_TRIG_TREQ_SEL_LSB 15
+#define DMA_CH0_CTRL_TRIG_IRQ_QUIET_BITS 0x00200000
+#define DMA_CH0_CTRL_TRIG_BUSY_BITS 0x01000000
+
+#endif // dma.h
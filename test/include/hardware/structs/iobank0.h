@@ -0,0 +1,18 @@
+#ifndef _HARDWARE_STRUCTS_IOBANK0_H
+#define _HARDWARE_STRUCTS_IOBANK0_H
+// Host build stand-in for the rp2040 sdk iobank0 register definitions
+
+#include "hardware/address_mapped.h" // io_rw_32
+
+typedef struct {
+    struct {
+        io_rw_32 status, ctrl;
+    } io[30];
+} iobank0_hw_t;
+
+HOSTSIM_EXTERN iobank0_hw_t hostsim_iobank0;
+#define iobank0_hw (&hostsim_iobank0)
+
+#define IO_BANK0_GPIO0_CTRL_FUNCSEL_LSB 0
+
+#endif // iobank0.h
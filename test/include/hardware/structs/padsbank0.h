@@ -0,0 +1,21 @@
+#ifndef _HARDWARE_STRUCTS_PADSBANK0_H
+#define _HARDWARE_STRUCTS_PADSBANK0_H
+// Host build stand-in for the rp2040 sdk padsbank0 register definitions
+
+#include "hardware/address_mapped.h" // io_rw_32
+
+typedef struct {
+    io_rw_32 voltage_select;
+    io_rw_32 io[30];
+} padsbank0_hw_t;
+
+HOSTSIM_EXTERN padsbank0_hw_t hostsim_padsbank0;
+#define padsbank0_hw (&hostsim_padsbank0)
+
+#define PADS_BANK0_GPIO0_IE_BITS 0x00000040
+#define PADS_BANK0_GPIO0_DRIVE_MSB 5
+#define PADS_BANK0_GPIO0_DRIVE_VALUE_4MA 0x1
+#define PADS_BANK0_GPIO0_PUE_BITS 0x00000008
+#define PADS_BANK0_GPIO0_PDE_BITS 0x00000004
+
+#endif // padsbank0.h
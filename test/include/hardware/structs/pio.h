@@ -0,0 +1,58 @@
+#ifndef _HARDWARE_STRUCTS_PIO_H
+#define _HARDWARE_STRUCTS_PIO_H
+// Host build stand-in for the rp2040 sdk pio register definitions
+
+#include "hardware/address_mapped.h" // io_rw_32
+
+typedef struct pio_sm_hw {
+    io_rw_32 clkdiv, execctrl, shiftctrl, addr, instr, pinctrl;
+} pio_sm_hw_t;
+
+typedef struct {
+    io_rw_32 ctrl, fstat, fdebug, flevel, txf[4], rxf[4], irq, irq_force;
+    io_rw_32 input_sync_bypass, dbg_padout, dbg_padoe, dbg_cfginfo;
+    io_rw_32 instr_mem[32];
+    pio_sm_hw_t sm[4];
+    io_rw_32 intr, inte0, intf0, ints0, inte1, intf1, ints1;
+} pio_hw_t;
+
+HOSTSIM_EXTERN pio_hw_t hostsim_pio0, hostsim_pio1;
+#define pio0_hw (&hostsim_pio0)
+#define pio1_hw (&hostsim_pio1)
+
+#define PIO_CTRL_SM_ENABLE_LSB 0
+#define PIO_CTRL_SM_RESTART_LSB 4
+#define PIO_CTRL_SM_RESTART_BITS 0x000000f0
+#define PIO_CTRL_CLKDIV_RESTART_LSB 8
+#define PIO_CTRL_CLKDIV_RESTART_BITS 0x00000f00
+#define PIO_FSTAT_RXEMPTY_LSB 8
+#define PIO_FDEBUG_RXSTALL_LSB 0
+#define PIO_FLEVEL_RX1_LSB 12
+#define PIO_FLEVEL_RX1_BITS 0x0000f000
+#define PIO_FLEVEL_TX3_BITS 0x0f000000
+#define PIO_SM0_CLKDIV_FRAC_LSB 8
+#define PIO_SM0_CLKDIV_INT_LSB 16
+#define PIO_SM0_EXECCTRL_JMP_PIN_LSB 24
+#define PIO_SM0_EXECCTRL_WRAP_TOP_LSB 12
+#define PIO_SM0_EXECCTRL_WRAP_BOTTOM_LSB 7
+#define PIO_SM0_SHIFTCTRL_FJOIN_RX_BITS 0x80000000
+#define PIO_SM0_SHIFTCTRL_FJOIN_TX_BITS 0x40000000
+#define PIO_SM0_SHIFTCTRL_PULL_THRESH_LSB 25
+#define PIO_SM0_SHIFTCTRL_PUSH_THRESH_LSB 20
+#define PIO_SM0_SHIFTCTRL_OUT_SHIFTDIR_BITS 0x00080000
+#define PIO_SM0_SHIFTCTRL_IN_SHIFTDIR_BITS 0x00040000
+#define PIO_SM0_SHIFTCTRL_AUTOPULL_BITS 0x00020000
+#define PIO_SM0_SHIFTCTRL_AUTOPUSH_BITS 0x00010000
+#define PIO_SM0_PINCTRL_SET_COUNT_LSB 26
+#define PIO_SM0_PINCTRL_OUT_COUNT_LSB 20
+#define PIO_SM0_PINCTRL_IN_BASE_LSB 15
+#define PIO_SM0_PINCTRL_SET_BASE_LSB 5
+#define PIO_SM0_PINCTRL_OUT_BASE_LSB 0
+#define PIO_IRQ0_INTE_SM0_RXNEMPTY_BITS 0x00000001
+#define PIO_IRQ0_INTE_SM1_RXNEMPTY_BITS 0x00000002
+#define PIO_IRQ0_INTE_SM0_BITS 0x00000100
+#define PIO_IRQ0_INTE_SM1_BITS 0x00000200
+#define PIO_IRQ0_INTE_SM2_BITS 0x00000400
+#define PIO_IRQ0_INTE_SM3_BITS 0x00000800
+
+#endif // pio.h
@@ -0,0 +1,18 @@
+#ifndef _HARDWARE_STRUCTS_RESETS_H
+#define _HARDWARE_STRUCTS_RESETS_H
+// Host build stand-in for the rp2040 sdk resets register definitions
+
+#include "hardware/address_mapped.h" // io_rw_32
+
+typedef struct {
+    io_rw_32 reset, wdsel, reset_done;
+} resets_hw_t;
+
+HOSTSIM_EXTERN resets_hw_t hostsim_resets;
+#define resets_hw (&hostsim_resets)
+
+#define RESETS_RESET_DMA_BITS 0x00000004
+#define RESETS_RESET_PIO0_BITS 0x00000400
+#define RESETS_RESET_PIO1_BITS 0x00000800
+
+#endif // resets.h
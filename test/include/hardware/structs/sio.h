@@ -0,0 +1,15 @@
+#ifndef _HARDWARE_STRUCTS_SIO_H
+#define _HARDWARE_STRUCTS_SIO_H
+// Host build stand-in for the rp2040 sdk sio register definitions
+
+#include "hardware/address_mapped.h" // io_rw_32
+
+typedef struct {
+    uint32_t _pad0[64];
+    io_rw_32 spinlock[32];
+} sio_hw_t;
+
+HOSTSIM_EXTERN sio_hw_t hostsim_sio;
+#define sio_hw (&hostsim_sio)
+
+#endif // sio.h
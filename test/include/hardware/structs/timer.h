@@ -0,0 +1,15 @@
+#ifndef _HARDWARE_STRUCTS_TIMER_H
+#define _HARDWARE_STRUCTS_TIMER_H
+// Host build stand-in for the rp2040 sdk timer register definitions
+
+#include "hardware/address_mapped.h" // io_rw_32
+
+typedef struct {
+    io_rw_32 timehw, timelw, timehr, timelr, alarm[4], armed;
+    io_rw_32 timerawh, timerawl;
+} timer_hw_t;
+
+HOSTSIM_EXTERN timer_hw_t hostsim_timer;
+#define timer_hw (&hostsim_timer)
+
+#endif // timer.h
@@ -0,0 +1,162 @@
+// Stress transmits from multiple producers (can2040_tx_lock_config)
+//
+// Two threads act as two ARM cores scheduling transmits at the same
+// time (using can2040_transmit(), can2040_transmit_prepared(), and
+// can2040_transmit_batch()) while a third thread acts as the irq
+// handler placing the queued messages on the bus.  The producers
+// contend for the modeled rp2040 hardware spinlock (see hostsim.c).
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <pthread.h> // pthread_create
+#include <sched.h> // sched_yield
+#include <stdint.h> // uintptr_t
+#include <stdio.h> // printf
+#include <string.h> // memset
+#include "hostsim.h" // hostsim_tx_bus_next
+
+#define NUM_MSGS 20000
+#define NUM_PRODUCERS 2
+#define QUEUE_SIZE 16
+
+static struct can2040 cd;
+static struct can2040_transmit tx_queue[QUEUE_SIZE];
+static uint32_t tx_next[NUM_PRODUCERS], bad_count, error_count;
+static uint32_t producers_done, stop;
+
+// Contents of the message with a given producer and sequence number
+static void
+fill_msg(struct can2040_msg *msg, uint32_t prod, uint32_t seq)
+{
+    memset(msg, 0, sizeof(*msg));
+    msg->id = 0x100 + prod;
+    msg->dlc = 8;
+    msg->data32[0] = (prod << 24) | seq;
+    msg->data32[1] = ~msg->data32[0];
+}
+
+// Callback (run from the irq thread) - check per producer order
+static void
+tx_cb(struct can2040 *cd, uint32_t notify, struct can2040_msg *msg)
+{
+    if (notify != CAN2040_NOTIFY_TX) {
+        error_count++;
+        return;
+    }
+    uint32_t prod = msg->data32[0] >> 24;
+    if (prod >= NUM_PRODUCERS) {
+        bad_count++;
+        return;
+    }
+    struct can2040_msg ref;
+    fill_msg(&ref, prod, tx_next[prod]++);
+    if (msg->id != ref.id || msg->dlc != ref.dlc
+        || msg->data32[0] != ref.data32[0]
+        || msg->data32[1] != ref.data32[1])
+        bad_count++;
+}
+
+// Application core - schedule this producer's messages
+static void *
+producer_thread(void *arg)
+{
+    uint32_t prod = (uintptr_t)arg, seq = 0;
+    struct can2040_msg msgs[4];
+    struct can2040_prepared pm;
+    fill_msg(&msgs[0], prod, 0);
+    can2040_prepare(&pm, &msgs[0]);
+    while (seq < NUM_MSGS && !__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+        uint32_t count = NUM_MSGS - seq < 4 ? NUM_MSGS - seq : 4, i;
+        for (i=0; i<count; i++)
+            fill_msg(&msgs[i], prod, seq + i);
+        int ret;
+        switch (seq % 3) {
+        case 0:
+            ret = can2040_transmit(&cd, &msgs[0]) ? 0 : 1;
+            break;
+        case 1:
+            ret = can2040_transmit_prepared(&cd, &pm, msgs[0].data) ? 0 : 1;
+            break;
+        default:
+            ret = can2040_transmit_batch(&cd, msgs, count);
+            break;
+        }
+        if (ret > 0)
+            seq += ret;
+        else
+            // Queue full - let the irq handler make progress
+            sched_yield();
+    }
+    __atomic_add_fetch(&producers_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Dedicated core - send queued transmits
+static void
+irq_loop(void)
+{
+    for (;;) {
+        int is_done = (__atomic_load_n(&producers_done, __ATOMIC_ACQUIRE)
+                       == NUM_PRODUCERS);
+        struct can2040_msg msg;
+        int ret = hostsim_tx_bus_next(&cd, &msg);
+        if (!ret)
+            continue;
+        if (ret == -2) {
+            // Queue entry does not match the message encoding
+            bad_count++;
+            __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+            break;
+        }
+        if (is_done)
+            break;
+        sched_yield();
+    }
+}
+
+static int
+check_producers(uint32_t tx_priority)
+{
+    memset(tx_next, 0, sizeof(tx_next));
+    bad_count = error_count = producers_done = stop = 0;
+    can2040_setup(&cd, 0);
+    can2040_callback_config(&cd, tx_cb);
+    can2040_tx_queue_config(&cd, tx_queue, QUEUE_SIZE);
+    can2040_tx_lock_config(&cd, 31);
+    can2040_tx_priority_config(&cd, tx_priority);
+    hostsim_start(&cd);
+    hostsim_dmb_yield(1);
+    uint32_t contended = hostsim_spinlock_contended();
+
+    pthread_t t[NUM_PRODUCERS];
+    uintptr_t i;
+    for (i=0; i<NUM_PRODUCERS; i++)
+        pthread_create(&t[i], NULL, producer_thread, (void*)i);
+    irq_loop();
+    for (i=0; i<NUM_PRODUCERS; i++)
+        pthread_join(t[i], NULL);
+    hostsim_dmb_yield(0);
+    contended = hostsim_spinlock_contended() - contended;
+
+    struct can2040_stats stats;
+    can2040_get_statistics(&cd, &stats);
+    // The producers must have actually contended for the spinlock
+    int bad = (bad_count || error_count || !contended
+               || stats.tx_total != NUM_MSGS * NUM_PRODUCERS);
+    for (i=0; i<NUM_PRODUCERS; i++)
+        if (tx_next[i] != NUM_MSGS)
+            bad = 1;
+    printf("producers=%u priority=%u: tx_total=%u tx_queue_max=%u"
+           " contended=%u bad=%u errors=%u %s\n", NUM_PRODUCERS, tx_priority
+           , stats.tx_total, stats.tx_queue_max, contended, bad_count
+           , error_count, bad ? "FAIL" : "ok");
+    return bad;
+}
+
+int
+main(int argc, char **argv)
+{
+    int bad = check_producers(0);
+    bad |= check_producers(1);
+    return bad;
+}
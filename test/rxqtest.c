@@ -0,0 +1,137 @@
+// Stress the zero-copy receive queue (can2040_rx_queue_config)
+//
+// One thread acts as the irq handler receiving frames directly into the
+// queue while the main thread reads them with can2040_rx_peek() and
+// can2040_rx_poll().  The reader is deliberately slow at times so that
+// the queue wraps many times and frequently overruns.  A queue may
+// also be used without any callback configured.
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <pthread.h> // pthread_create
+#include <sched.h> // sched_yield
+#include <stdio.h> // printf
+#include <string.h> // memset
+#include "hostsim.h" // hostsim_feed_frame
+
+#define NUM_MSGS 20000
+#define QUEUE_SIZE 4
+
+static struct can2040 cd;
+static struct can2040_msg rx_queue[QUEUE_SIZE];
+static uint32_t done, error_count;
+
+// Callback (only errors are reported here when a queue is in use)
+static void
+rx_cb(struct can2040 *cd, uint32_t notify, struct can2040_msg *msg)
+{
+    __atomic_add_fetch(&error_count, 1, __ATOMIC_RELAXED);
+}
+
+// Irq handler - receive frames into the queue
+static void *
+irq_thread(void *arg)
+{
+    uint32_t seq, seed = 1;
+    for (seq=0; seq<NUM_MSGS; seq++) {
+        // Let the reader catch up some of the time
+        seed = seed * 1103515245 + 12345;
+        if ((seed >> 16) % 4)
+            sched_yield();
+        struct can2040_msg msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.id = seq & 0x7ff;
+        msg.dlc = 8;
+        msg.data32[0] = seq;
+        msg.data32[1] = ~seq;
+        hostsim_feed_frame(&cd, &msg);
+    }
+    __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static int
+test_stress(void)
+{
+    can2040_setup(&cd, 0);
+    can2040_callback_config(&cd, rx_cb);
+    can2040_rx_queue_config(&cd, rx_queue, QUEUE_SIZE);
+    hostsim_start(&cd);
+    hostsim_dmb_yield(1);
+
+    pthread_t t;
+    pthread_create(&t, NULL, irq_thread, NULL);
+    uint32_t count = 0, torn = 0, order = 0, last_seq = 0, seed = 1;
+    for (;;) {
+        int is_done = __atomic_load_n(&done, __ATOMIC_ACQUIRE);
+        struct can2040_msg *qm = can2040_rx_peek(&cd);
+        if (!qm) {
+            if (is_done)
+                break;
+            continue;
+        }
+        // Check the entry in place, then again after a random delay (the
+        // entry must not change until it is released)
+        uint32_t seq = qm->data32[0], pass;
+        for (pass=0; pass<2; pass++) {
+            if (qm->id != (seq & 0x7ff) || qm->dlc != 8
+                || qm->data32[0] != seq || qm->data32[1] != ~seq)
+                torn++;
+            seed = seed * 1103515245 + 12345;
+            if (!((seed >> 16) % 3))
+                sched_yield();
+        }
+        if (count && seq <= last_seq)
+            order++;
+        last_seq = seq;
+        count++;
+        can2040_rx_poll(&cd, NULL);
+    }
+    pthread_join(t, NULL);
+    hostsim_dmb_yield(0);
+
+    struct can2040_stats stats;
+    can2040_get_statistics(&cd, &stats);
+    int bad = (torn || order || error_count || count != stats.rx_total
+               || stats.rx_total + stats.rx_overrun != NUM_MSGS
+               || !stats.rx_overrun);
+    printf("rx queue: read=%u rx_total=%u rx_overrun=%u torn=%u order=%u"
+           " errors=%u %s\n", count, stats.rx_total, stats.rx_overrun
+           , torn, order, error_count, bad ? "FAIL" : "ok");
+    return bad;
+}
+
+// Poll the queue without a callback (tx events are discarded)
+static int
+test_no_callback(void)
+{
+    can2040_setup(&cd, 0);
+    can2040_rx_queue_config(&cd, rx_queue, QUEUE_SIZE);
+    hostsim_start(&cd);
+
+    struct can2040_msg msg, rmsg;
+    memset(&msg, 0, sizeof(msg));
+    msg.id = 0x123;
+    msg.dlc = 2;
+    msg.data32[0] = 0x5aa5;
+    hostsim_feed_frame(&cd, &msg);
+    int bad = can2040_rx_poll(&cd, &rmsg) || rmsg.id != msg.id;
+    bad |= (can2040_transmit(&cd, &msg) || hostsim_tx_bus_next(&cd, &rmsg)
+            || rmsg.id != msg.id);
+    struct can2040_stats stats;
+    can2040_get_statistics(&cd, &stats);
+    bad |= (stats.rx_total != 1 || stats.tx_total != 1
+            || stats.notify_dropped != 1);
+    printf("rx queue without callback: rx_total=%u tx_total=%u"
+           " notify_dropped=%u %s\n", stats.rx_total, stats.tx_total
+           , stats.notify_dropped, bad ? "FAIL" : "ok");
+    return bad;
+}
+
+int
+main(int argc, char **argv)
+{
+    int bad = test_stress();
+    bad |= test_no_callback();
+    return bad;
+}
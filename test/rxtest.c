@@ -0,0 +1,301 @@
+// Check the can2040 parser against generated frames
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <stddef.h> // offsetof
+#include <stdio.h> // printf
+#include <stdlib.h> // rand
+#include <string.h> // memset
+#include "hardware/structs/dma.h" // hostsim_dma
+#include "hardware/structs/iobank0.h" // hostsim_iobank0
+#include "hardware/structs/padsbank0.h" // hostsim_padsbank0
+#include "hardware/structs/pio.h" // hostsim_pio0
+#include "hostsim.h" // hostsim_encode_frame
+
+#define NUM_MSGS 40
+
+static struct can2040_msg got[NUM_MSGS];
+static uint32_t got_count, got_errors;
+
+static void
+rx_cb(struct can2040 *cd, uint32_t notify, struct can2040_msg *msg)
+{
+    if (notify != CAN2040_NOTIFY_RX)
+        got_errors++;
+    else if (got_count < NUM_MSGS)
+        got[got_count++] = *msg;
+}
+
+// Generate a mix of standard, extended, and remote frames
+static void
+build_msgs(struct can2040_msg *msgs)
+{
+    int i, j;
+    for (i=0; i<NUM_MSGS; i++) {
+        struct can2040_msg *m = &msgs[i];
+        memset(m, 0, sizeof(*m));
+        m->id = rand() & 0x7ff;
+        if (i % 3 == 1)
+            m->id = (rand() & 0x1fffffff) | CAN2040_ID_EFF;
+        if (i % 7 == 3)
+            m->id |= CAN2040_ID_RTR;
+        m->dlc = i % 10;
+        if (i % 5 == 0)
+            m->dlc = 8;
+        if (m->id & CAN2040_ID_RTR)
+            continue;
+        for (j=0; j<8 && j<m->dlc; j++)
+            m->data[j] = i % 4 == 0 ? 0x00 : (i % 4 == 1 ? 0xff : rand());
+    }
+}
+
+static int
+msg_equal(struct can2040_msg *a, struct can2040_msg *b)
+{
+    return (a->id == b->id && a->dlc == b->dlc
+            && a->data32[0] == b->data32[0] && a->data32[1] == b->data32[1]);
+}
+
+// Feed all messages (as one stream) and check they are reported in order
+static int
+check_stream(struct can2040_msg *msgs, uint32_t wake_bits)
+{
+    static uint8_t bits[NUM_MSGS * (13 + HS_MAX_FRAME_BITS) + 64];
+    static uint32_t words[sizeof(bits) / 10 + 1];
+    uint32_t count = 0, i;
+    for (i=0; i<NUM_MSGS; i++) {
+        memset(&bits[count], 1, 13);
+        count += 13;
+        count += hostsim_encode_frame(&msgs[i], &bits[count]);
+    }
+    memset(&bits[count], 1, 30);
+    count += 30;
+
+    struct can2040 cd;
+    can2040_setup(&cd, 0);
+    can2040_callback_config(&cd, rx_cb);
+    if (wake_bits > 10)
+        // Larger entries are only used in listen-only mode
+        can2040_listen_only_config(&cd, 1);
+    can2040_rx_wake_config(&cd, wake_bits);
+    hostsim_start(&cd);
+    got_count = got_errors = 0;
+    uint32_t nwords = hostsim_pack_words(bits, count, wake_bits, words);
+    hostsim_feed_words(&cd, words, nwords);
+
+    int bad = got_count != NUM_MSGS || got_errors;
+    for (i=0; i<got_count; i++)
+        if (!msg_equal(&got[i], &msgs[i]))
+            bad = 1;
+    struct can2040_stats stats;
+    can2040_get_statistics(&cd, &stats);
+    printf("wake_bits=%u: rx_total=%u parse_error=%u %s\n"
+           , wake_bits, stats.rx_total, stats.parse_error
+           , bad ? "FAIL" : "ok");
+    return bad;
+}
+
+// Check that larger rx fifo entries are rejected unless listen-only
+static int
+check_wake_config(void)
+{
+    struct can2040 cd;
+    can2040_setup(&cd, 0);
+    int ret20 = can2040_rx_wake_config(&cd, 20);
+    int bad = !ret20 || cd.rx_wake_bits != 10;
+    bad |= can2040_rx_wake_config(&cd, 10) != 0;
+    can2040_listen_only_config(&cd, 1);
+    int ret30 = can2040_rx_wake_config(&cd, 30);
+    bad |= ret30 || cd.rx_wake_bits != 30;
+    can2040_listen_only_config(&cd, 0);
+    bad |= cd.rx_wake_bits != 10;
+    printf("wake config: normal=%d listen_only=%d %s\n"
+           , ret20, ret30, bad ? "FAIL" : "ok");
+    return bad;
+}
+
+// Check that a frame with any single bit flipped is not accepted
+static int
+check_bit_errors(struct can2040_msg *msgs)
+{
+    uint8_t bits[13 + HS_MAX_FRAME_BITS + 30];
+    uint32_t words[sizeof(bits) / 10 + 1];
+    uint32_t accepted = 0, tests = 0, i, pos;
+    for (i=0; i<NUM_MSGS; i++) {
+        uint32_t count = 13;
+        memset(bits, 1, count);
+        uint32_t flen = hostsim_encode_frame(&msgs[i], &bits[count]);
+        memset(&bits[count + flen], 1, 30);
+        // Flip each bit from sof to the end of the crc delimiter
+        for (pos=0; pos<flen - 11; pos++) {
+            struct can2040 cd;
+            can2040_setup(&cd, 0);
+            can2040_callback_config(&cd, rx_cb);
+            hostsim_start(&cd);
+            got_count = got_errors = 0;
+            bits[count + pos] ^= 1;
+            uint32_t nwords = hostsim_pack_words(bits, count + flen + 30
+                                                 , 10, words);
+            hostsim_feed_words(&cd, words, nwords);
+            bits[count + pos] ^= 1;
+            if (got_count && msg_equal(&got[0], &msgs[i]))
+                accepted++;
+            tests++;
+        }
+    }
+    printf("single bit errors: %u tests, %u accepted %s\n"
+           , tests, accepted, accepted ? "FAIL" : "ok");
+    return !!accepted;
+}
+
+#define GPIO_TX 5 // See hostsim_start()
+#define SM_TX 3
+#define TX_INSTR_START 25
+
+static uint32_t tx_access_count;
+
+// Note register writes that would alter the PIO "tx" state machine, its
+// instructions, or the tx gpio
+static int
+listen_only_hook(uint32_t dev, uint32_t offset, uint32_t is_write
+                 , uint32_t *val)
+{
+    if (!is_write)
+        return 0;
+    if (dev == HS_PIO0) {
+        uint32_t sm_start = offsetof(pio_hw_t, sm[SM_TX]);
+        uint32_t instr_start = offsetof(pio_hw_t, instr_mem[TX_INSTR_START]);
+        if ((offset >= sm_start && offset < sm_start + sizeof(pio_sm_hw_t))
+            || (offset >= instr_start
+                && offset < offsetof(pio_hw_t, instr_mem[32]))
+            || offset == offsetof(pio_hw_t, txf[SM_TX]))
+            tx_access_count++;
+        // The "tx" state machine must stay enabled and not be restarted
+        if (offset == offsetof(pio_hw_t, ctrl)
+            && (!(*val & (1 << SM_TX)) || *val & ((0x10 | 0x100) << SM_TX)))
+            tx_access_count++;
+    } else if (dev == HS_IOBANK0) {
+        if (offset / sizeof(hostsim_iobank0.io[0]) == GPIO_TX)
+            tx_access_count++;
+    } else if (dev == HS_PADSBANK0) {
+        if (offset == offsetof(padsbank0_hw_t, io[GPIO_TX]))
+            tx_access_count++;
+    }
+    return 0;
+}
+
+// Check that listen-only mode leaves the "tx" state machine and gpio alone
+static int
+check_listen_only(struct can2040_msg *msgs)
+{
+    // State of a user program running on the PIO "tx" state machine
+    memset(&hostsim_pio0, 0, sizeof(hostsim_pio0));
+    hostsim_pio0.ctrl = 1 << SM_TX;
+    hostsim_pio0.sm[SM_TX].pinctrl = 0x12345678;
+    uint32_t i;
+    for (i=TX_INSTR_START; i<32; i++)
+        hostsim_pio0.instr_mem[i] = 0xe000 + i;
+    hostsim_iobank0.io[GPIO_TX].ctrl = 0x1f;
+    hostsim_padsbank0.io[GPIO_TX] = 0x56;
+
+    hostsim_io_hook_config(listen_only_hook);
+    tx_access_count = 0;
+    struct can2040 cd;
+    can2040_setup(&cd, 0);
+    can2040_callback_config(&cd, rx_cb);
+    can2040_listen_only_config(&cd, 1);
+    hostsim_start(&cd);
+    got_count = got_errors = 0;
+    for (i=0; i<NUM_MSGS; i++)
+        hostsim_feed_frame(&cd, &msgs[i]);
+    int tx_ret = can2040_transmit(&cd, &msgs[0]);
+    hostsim_io_hook_config(NULL);
+
+    int bad = (got_count != NUM_MSGS || got_errors || !tx_ret
+               || tx_access_count
+               || (hostsim_pio0.ctrl & 0x0f) != 0x0f
+               || hostsim_pio0.sm[SM_TX].pinctrl != 0x12345678
+               || hostsim_iobank0.io[GPIO_TX].ctrl != 0x1f
+               || hostsim_padsbank0.io[GPIO_TX] != 0x56);
+    for (i=TX_INSTR_START; i<32; i++)
+        if (hostsim_pio0.instr_mem[i] != 0xe000 + i)
+            bad = 1;
+    printf("listen-only: rx=%u tx_accesses=%u ctrl=0x%03x %s\n"
+           , got_count, tx_access_count, hostsim_pio0.ctrl
+           , bad ? "FAIL" : "ok");
+    return bad;
+}
+
+// Simulated PIO "rx" fifo contents (read by the cpu)
+static uint32_t fifo_words[NUM_MSGS * (13 + HS_MAX_FRAME_BITS) / 10 + 1];
+static uint32_t fifo_pos, fifo_count, fifo_reads;
+
+static int
+rx_fifo_hook(uint32_t dev, uint32_t offset, uint32_t is_write, uint32_t *val)
+{
+    if (dev != HS_PIO0 || is_write)
+        return 0;
+    if (offset == offsetof(pio_hw_t, ints0)) {
+        *val = fifo_pos < fifo_count ? PIO_IRQ0_INTE_SM1_RXNEMPTY_BITS : 0;
+        return 1;
+    }
+    if (offset == offsetof(pio_hw_t, rxf[1])) {
+        *val = fifo_pos < fifo_count ? fifo_words[fifo_pos++] : 0;
+        fifo_reads++;
+        return 1;
+    }
+    return 0;
+}
+
+// Check that the irq handler reads the rx fifo if the dma channel stops
+static int
+check_dma_stopped(struct can2040_msg *msgs)
+{
+    static uint8_t bits[NUM_MSGS * (13 + HS_MAX_FRAME_BITS)];
+    static uint32_t rx_ring[32] __attribute__((aligned(128)));
+    uint32_t count = 0, i;
+    for (i=0; i<NUM_MSGS; i++) {
+        memset(&bits[count], 1, 13);
+        count += 13;
+        count += hostsim_encode_frame(&msgs[i], &bits[count]);
+    }
+    fifo_count = hostsim_pack_words(bits, count, 10, fifo_words);
+    fifo_pos = fifo_reads = 0;
+
+    struct can2040 cd;
+    can2040_setup(&cd, 0);
+    can2040_callback_config(&cd, rx_cb);
+    can2040_rx_dma_config(&cd, 0, rx_ring, 32);
+    hostsim_start(&cd);
+    // Dma channel has stopped without copying the fifo entries
+    hostsim_dma.ch[0].ctrl_trig &= ~DMA_CH0_CTRL_TRIG_BUSY_BITS;
+    got_count = got_errors = 0;
+    hostsim_io_hook_config(rx_fifo_hook);
+    can2040_pio_irq_handler(&cd);
+    hostsim_io_hook_config(NULL);
+
+    int bad = got_count != NUM_MSGS || got_errors || fifo_pos != fifo_count;
+    for (i=0; i<got_count; i++)
+        if (!msg_equal(&got[i], &msgs[i]))
+            bad = 1;
+    printf("dma stopped: fifo_reads=%u rx=%u %s\n"
+           , fifo_reads, got_count, bad ? "FAIL" : "ok");
+    return bad;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct can2040_msg msgs[NUM_MSGS];
+    srand(1);
+    build_msgs(msgs);
+    int bad = check_wake_config();
+    bad |= check_stream(msgs, 10);
+    bad |= check_stream(msgs, 20);
+    bad |= check_stream(msgs, 30);
+    bad |= check_bit_errors(msgs);
+    bad |= check_listen_only(msgs);
+    bad |= check_dma_stopped(msgs);
+    printf(bad ? "FAIL\n" : "PASS\n");
+    return bad;
+}
@@ -0,0 +1,283 @@
+// Check the bus statistics (can2040_bus_load_update) and the per-id
+// statistics table (can2040_id_stats_config)
+//
+// Frames with a known number of raw bits are fed to the parser and the
+// rp2040 timer is advanced to match (one bit per microsecond), so the
+// expected bus load, stuff bit ratio, and message intervals can be
+// calculated exactly.
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <stdio.h> // printf
+#include <string.h> // memset
+#include "hardware/structs/timer.h" // hostsim_timer
+#include "hostsim.h" // hostsim_feed_frame
+
+#define IDLE_BITS 11 // Idle bits before each frame in hostsim_feed_frame()
+
+static struct can2040 cd;
+static uint32_t rx_count, error_count;
+
+static void
+rx_cb(struct can2040 *cd, uint32_t notify, struct can2040_msg *msg)
+{
+    if (notify == CAN2040_NOTIFY_RX)
+        rx_count++;
+    else
+        error_count++;
+}
+
+static void
+start(void)
+{
+    memset(&cd, 0, sizeof(cd));
+    can2040_setup(&cd, 0);
+    can2040_callback_config(&cd, rx_cb);
+    hostsim_start(&cd);
+    rx_count = error_count = 0;
+}
+
+// Contents of test message 'seq' (a mix of ids, lengths, and data)
+static void
+fill_msg(struct can2040_msg *msg, uint32_t seq)
+{
+    memset(msg, 0, sizeof(*msg));
+    msg->id = 0x100 + seq * 0x25;
+    if (seq % 3 == 1)
+        msg->id = (msg->id << 14) | seq | CAN2040_ID_EFF;
+    msg->dlc = seq % 9;
+    if (seq % 4)
+        msg->data32[0] = msg->data32[1] = seq * 0x01010101;
+}
+
+// Feed a frame to the parser and return the raw bits it used on the bus
+static uint32_t
+feed_msg(struct can2040_msg *msg, uint32_t *stuff_bits)
+{
+    uint8_t bits[HS_MAX_FRAME_BITS];
+    uint32_t count = hostsim_encode_frame(msg, bits);
+    // Unstuffed bits from sof to the end of eof
+    uint32_t nominal = (msg->id & CAN2040_ID_EFF ? 64 : 44) + msg->dlc * 8;
+    *stuff_bits += count - 3 - nominal;
+    hostsim_feed_frame(&cd, msg);
+    return count;
+}
+
+// Feed a frame with a corrupted crc
+static void
+feed_bad_msg(struct can2040_msg *msg)
+{
+    uint8_t bits[IDLE_BITS + HS_MAX_FRAME_BITS];
+    uint32_t words[IDLE_BITS + HS_MAX_FRAME_BITS];
+    memset(bits, 1, IDLE_BITS);
+    uint32_t count = IDLE_BITS + hostsim_encode_frame(msg, &bits[IDLE_BITS]);
+    // Invert a bit in the crc (before crc delimiter, ack, eof, and ifs)
+    bits[count - 1 - 3 - 7 - 1 - 1 - 4] ^= 1;
+    count = hostsim_pack_words(bits, count, cd.rx_wake_bits, words);
+    hostsim_feed_words(&cd, words, count);
+}
+
+// Advance the rp2040 timer by the given number of bit times (at 1Mbit/s)
+static void
+advance_time(uint32_t bits)
+{
+    hostsim_timer.timerawl += bits;
+}
+
+#define NUM_MSGS 100
+#define EXTRA_IDLE 5000
+
+static int
+test_bus_load(void)
+{
+    start();
+    struct can2040_bus_load bl;
+    memset(&bl, 0, sizeof(bl));
+    int bad = can2040_bus_load_update(&cd, &bl, 1000) != 0;
+
+    // Frames separated by idle bits, followed by a long idle period
+    uint32_t busy = 0, stuff = 0, seq;
+    struct can2040_msg msg;
+    for (seq=0; seq<NUM_MSGS; seq++) {
+        fill_msg(&msg, seq);
+        uint32_t count = feed_msg(&msg, &stuff);
+        busy += count;
+        advance_time(IDLE_BITS + count);
+    }
+    advance_time(EXTRA_IDLE);
+    uint32_t elapsed = busy + NUM_MSGS * IDLE_BITS + EXTRA_IDLE;
+    struct can2040_stats stats;
+    can2040_get_statistics(&cd, &stats);
+    bad |= (stats.bus_bits != busy || stats.stuff_bits != stuff
+            || rx_count != NUM_MSGS || error_count);
+    bad |= can2040_bus_load_update(&cd, &bl, 1000) != 1;
+    uint32_t load = busy * 1000ULL / elapsed, ratio = stuff * 1000 / busy;
+    bad |= bl.load != load || bl.stuff_ratio != ratio;
+    printf("bus load: bus_bits=%u stuff_bits=%u load=%u/%u"
+           " stuff_ratio=%u/%u %s\n", stats.bus_bits, stats.stuff_bits
+           , bl.load, load, bl.stuff_ratio, ratio, bad ? "FAIL" : "ok");
+
+    // Error frames add to bus_bits but not to stuff_bits - so they lower
+    // the reported stuff_ratio
+    uint32_t err_bits = stats.bus_bits, err_stuff = stats.stuff_bits;
+    for (seq=0; seq<NUM_MSGS; seq++) {
+        fill_msg(&msg, seq);
+        feed_bad_msg(&msg);
+    }
+    can2040_get_statistics(&cd, &stats);
+    err_bits = stats.bus_bits - err_bits;
+    err_stuff = stats.stuff_bits - err_stuff;
+    int bad2 = (!err_bits || err_stuff || stats.parse_error != NUM_MSGS
+                || rx_count != NUM_MSGS || error_count);
+    stuff = 0;
+    for (seq=0; seq<NUM_MSGS; seq++) {
+        fill_msg(&msg, seq);
+        feed_msg(&msg, &stuff);
+    }
+    advance_time(elapsed);
+    bad2 |= can2040_bus_load_update(&cd, &bl, 1000) != 1;
+    uint32_t err_ratio = stuff * 1000 / (busy + err_bits);
+    bad2 |= bl.stuff_ratio != err_ratio || err_ratio >= ratio;
+    printf("bus load with errors: error_bus_bits=%u stuff_ratio=%u/%u %s\n"
+           , err_bits, bl.stuff_ratio, err_ratio, bad2 ? "FAIL" : "ok");
+    return bad || bad2;
+}
+
+// The meter may be polled before can2040_start() (no bitrate yet)
+static int
+test_bus_load_early(void)
+{
+    memset(&cd, 0, sizeof(cd));
+    can2040_setup(&cd, 0);
+    can2040_callback_config(&cd, rx_cb);
+    rx_count = error_count = 0;
+    struct can2040_bus_load bl;
+    memset(&bl, 0, sizeof(bl));
+    int bad = can2040_bus_load_update(&cd, &bl, 1000) != 0;
+    advance_time(2000);
+    bad |= can2040_bus_load_update(&cd, &bl, 1000) != 0;
+
+    // The window starts on the first call after can2040_start()
+    hostsim_start(&cd);
+    bad |= can2040_bus_load_update(&cd, &bl, 1000) != 0;
+    uint32_t stuff = 0, busy, elapsed = 4000;
+    struct can2040_msg msg;
+    fill_msg(&msg, 1);
+    busy = feed_msg(&msg, &stuff);
+    advance_time(elapsed);
+    bad |= can2040_bus_load_update(&cd, &bl, 1000) != 1;
+    uint32_t load = busy * 1000ULL / elapsed;
+    bad |= bl.load != load || rx_count != 1 || error_count;
+    printf("bus load before start: load=%u/%u %s\n"
+           , bl.load, load, bad ? "FAIL" : "ok");
+    return bad;
+}
+
+#define IDS_SIZE 8
+#define IDS_EXTRA 24
+
+static struct can2040_id_stats id_stats[IDS_SIZE];
+
+// Find the per-id statistics of an id (or return -1 if not present)
+static int
+find_id_stats(uint32_t id, struct can2040_id_stats *is)
+{
+    uint32_t i;
+    for (i=0; i<IDS_SIZE; i++)
+        if (!can2040_get_id_statistics(&cd, i, is) && is->id == id)
+            return 0;
+    return -1;
+}
+
+static int
+test_id_stats(void)
+{
+    start();
+    can2040_id_stats_config(&cd, id_stats, IDS_SIZE);
+
+    // Three ids sent at different intervals
+    static const struct { uint32_t id, dlc, interval; } ids[] = {
+        { 0x123, 8, 100 }, { 0x12345 | CAN2040_ID_EFF, 2, 250 },
+        { 0x7ff | CAN2040_ID_RTR, 4, 400 },
+    };
+    uint32_t i, t, frames = 0;
+    struct can2040_msg msg;
+    for (t=1; t<=2000; t++) {
+        advance_time(1);
+        for (i=0; i<3; i++) {
+            if (t % ids[i].interval)
+                continue;
+            memset(&msg, 0, sizeof(msg));
+            msg.id = ids[i].id;
+            msg.dlc = ids[i].dlc;
+            hostsim_feed_frame(&cd, &msg);
+            frames++;
+        }
+    }
+    int bad = rx_count != frames;
+    struct can2040_id_stats is;
+    for (i=0; i<3; i++) {
+        uint32_t count = 2000 / ids[i].interval;
+        uint32_t bytes = ids[i].id & CAN2040_ID_RTR ? 0 : count * ids[i].dlc;
+        bad |= (find_id_stats(ids[i].id & ~CAN2040_ID_RTR, &is)
+                || is.frames != count || is.bytes != bytes || is.errors
+                || is.min_interval != ids[i].interval
+                || is.max_interval != ids[i].interval
+                || is.last_time != hostsim_timer.timerawl);
+    }
+
+    // A crc error is counted against an id already in the table
+    memset(&msg, 0, sizeof(msg));
+    msg.id = 0x123;
+    feed_bad_msg(&msg);
+    advance_time(500);
+    msg.dlc = 8;
+    hostsim_feed_frame(&cd, &msg);
+    bad |= (find_id_stats(0x123, &is) || is.errors != 1
+            || is.frames != 21 || is.max_interval != 500);
+
+    // Fill the table with new ids - once full, new ids are not counted
+    // and existing entries are never evicted
+    for (i=0; i<IDS_SIZE + IDS_EXTRA; i++) {
+        msg.id = 0x200 + i;
+        hostsim_feed_frame(&cd, &msg);
+    }
+    struct can2040_stats stats;
+    can2040_get_statistics(&cd, &stats);
+    uint32_t used = 0, new_frames = 0;
+    for (i=0; i<IDS_SIZE; i++) {
+        if (can2040_get_id_statistics(&cd, i, &is))
+            continue;
+        used++;
+        if (is.id >= 0x200 && is.id < 0x200 + IDS_SIZE + IDS_EXTRA)
+            new_frames += is.frames;
+    }
+    bad |= (used != IDS_SIZE || stats.id_stats_full == 0
+            || new_frames + stats.id_stats_full != IDS_SIZE + IDS_EXTRA);
+    for (i=0; i<3; i++)
+        bad |= find_id_stats(ids[i].id & ~CAN2040_ID_RTR, &is) != 0;
+
+    // Ids in the table are still counted, errors on other ids are ignored
+    uint32_t full = stats.id_stats_full;
+    msg.id = 0x12345 | CAN2040_ID_EFF;
+    hostsim_feed_frame(&cd, &msg);
+    msg.id = 0x400;
+    feed_bad_msg(&msg);
+    can2040_get_statistics(&cd, &stats);
+    bad |= (find_id_stats(0x12345 | CAN2040_ID_EFF, &is) || is.frames != 9
+            || is.errors || stats.id_stats_full != full
+            || find_id_stats(0x400, &is) == 0);
+    bad |= error_count != 0;
+    printf("id stats: used=%u id_stats_full=%u %s\n"
+           , used, stats.id_stats_full, bad ? "FAIL" : "ok");
+    return bad;
+}
+
+int
+main(int argc, char **argv)
+{
+    int bad = test_bus_load();
+    bad |= test_bus_load_early();
+    bad |= test_id_stats();
+    return bad;
+}
@@ -0,0 +1,300 @@
+// Check the transmit queue priority order (can2040_tx_priority_config)
+// and prepared and batch transmits (can2040_transmit_prepared and
+// can2040_transmit_batch)
+//
+// The queue is kept full of messages with random ids.  Each message
+// placed on the bus must be the highest priority message queued, and
+// its queue entry must be available again as soon as it is sent.
+// Prepared messages must be queued exactly as can2040_transmit() would
+// queue the same message, and a batch that does not fit in the queue
+// must be partially accepted.  A queue larger than the 65536 entry
+// limit must be reduced to that limit.
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <stdio.h> // printf
+#include <stdlib.h> // rand
+#include <string.h> // memset
+#include "hostsim.h" // hostsim_tx_bus_next
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+#define NUM_MSGS 20000
+#define QUEUE_SIZE 16
+
+static struct can2040 cd;
+static struct can2040_transmit tx_queue[QUEUE_SIZE];
+static uint32_t error_count;
+
+// Messages currently queued (in the order passed to can2040_transmit)
+static struct can2040_msg pending[QUEUE_SIZE];
+static uint32_t pending_count;
+
+static void
+tx_cb(struct can2040 *cd, uint32_t notify, struct can2040_msg *msg)
+{
+    if (notify != CAN2040_NOTIFY_TX)
+        error_count++;
+}
+
+// Arbitration order of an id (see tx_arb_key() in can2040.c)
+static uint32_t
+arb_key(uint32_t id)
+{
+    if (id & CAN2040_ID_EFF)
+        return ((((id >> 18) & 0x7ff) << 21) | (1 << 20) | (1 << 19)
+                | ((id & 0x3ffff) << 1) | !!(id & CAN2040_ID_RTR));
+    return (((id & 0x7ff) << 21) | (!!(id & CAN2040_ID_RTR) << 20));
+}
+
+// Queue a message with a random id
+static int
+queue_msg(uint32_t seq)
+{
+    struct can2040_msg msg;
+    memset(&msg, 0, sizeof(msg));
+    // Use few ids so that messages with the same id are common
+    msg.id = (rand() % 32) * 0x21;
+    if (seq % 5 == 1)
+        msg.id = (msg.id << 18) | (rand() & 0x3) | CAN2040_ID_EFF;
+    msg.dlc = 8;
+    msg.data32[0] = seq;
+    msg.data32[1] = ~seq;
+    if (can2040_transmit(&cd, &msg))
+        return -1;
+    pending[pending_count++] = msg;
+    return 0;
+}
+
+// Remove the message that should be sent next from the pending list
+static struct can2040_msg
+pop_expected(void)
+{
+    uint32_t best = 0, i;
+    for (i=1; i<pending_count; i++)
+        if (arb_key(pending[i].id) < arb_key(pending[best].id))
+            best = i;
+    struct can2040_msg msg = pending[best];
+    memmove(&pending[best], &pending[best + 1]
+            , (pending_count - best - 1) * sizeof(pending[0]));
+    pending_count--;
+    return msg;
+}
+
+static int
+test_priority(void)
+{
+    can2040_setup(&cd, 0);
+    can2040_callback_config(&cd, tx_cb);
+    can2040_tx_queue_config(&cd, tx_queue, QUEUE_SIZE);
+    can2040_tx_priority_config(&cd, 1);
+    hostsim_start(&cd);
+    srand(1);
+
+    uint32_t seq = 0, sent = 0, order = 0, full = 0;
+    while (sent < NUM_MSGS && !error_count) {
+        // Every sent message must free its queue entry
+        while (pending_count < QUEUE_SIZE && seq < NUM_MSGS)
+            if (queue_msg(seq++)) {
+                full++;
+                break;
+            }
+        struct can2040_msg msg;
+        if (hostsim_tx_bus_next(&cd, &msg))
+            break;
+        struct can2040_msg exp = pop_expected();
+        if (msg.id != exp.id || msg.data32[0] != exp.data32[0]
+            || msg.data32[1] != exp.data32[1])
+            order++;
+        sent++;
+    }
+
+    int bad = sent != NUM_MSGS || order || full || error_count;
+    printf("tx priority: sent=%u order=%u full=%u errors=%u %s\n"
+           , sent, order, full, error_count, bad ? "FAIL" : "ok");
+    return bad;
+}
+
+#define PREPARED_MSGS 2000
+
+// Start a new instance (with stale data in the transmit queue)
+static void
+start_empty(void)
+{
+    memset(tx_queue, 0xa5, sizeof(tx_queue));
+    can2040_setup(&cd, 0);
+    can2040_callback_config(&cd, tx_cb);
+    can2040_tx_queue_config(&cd, tx_queue, QUEUE_SIZE);
+    hostsim_start(&cd);
+}
+
+// Random message with a mix of stuffing patterns
+static void
+random_msg(struct can2040_msg *msg)
+{
+    memset(msg, 0, sizeof(*msg));
+    msg->id = rand() & 0x7ff;
+    if (rand() % 3 == 0)
+        msg->id = (rand() & 0x1fffffff) | CAN2040_ID_EFF;
+    if (rand() % 8 == 0)
+        msg->id |= CAN2040_ID_RTR;
+    msg->dlc = rand() % 16;
+    uint32_t i;
+    for (i=0; i<8; i++) {
+        uint32_t r = rand();
+        msg->data[i] = r % 3 == 0 ? 0x00 : (r % 3 == 1 ? 0xff : r >> 8);
+    }
+}
+
+// Queue a message and return a copy of the transmit queue (and the
+// message sent on the bus)
+static int
+queue_and_send(struct can2040_msg *msg, struct can2040_prepared *pm
+               , const uint8_t *data, struct can2040_transmit *queue
+               , struct can2040_msg *sent)
+{
+    start_empty();
+    int ret = pm ? can2040_transmit_prepared(&cd, pm, data)
+                 : can2040_transmit(&cd, msg);
+    memcpy(queue, tx_queue, sizeof(tx_queue));
+    return ret || hostsim_tx_bus_next(&cd, sent);
+}
+
+static int
+test_prepared(void)
+{
+    static struct can2040_transmit ref_queue[QUEUE_SIZE], queue[QUEUE_SIZE];
+    struct can2040_msg msg, msg2, ref_sent, sent;
+    struct can2040_prepared pm;
+    uint32_t i, bad_count = 0;
+    srand(2);
+    for (i=0; i<PREPARED_MSGS; i++) {
+        random_msg(&msg);
+        can2040_prepare(&pm, &msg);
+        // A prepared message must be queued exactly as can2040_transmit()
+        int ret = queue_and_send(&msg, NULL, NULL, ref_queue, &ref_sent);
+        ret |= queue_and_send(&msg, &pm, NULL, queue, &sent);
+        if (ret || memcmp(queue, ref_queue, sizeof(queue))
+            || memcmp(&sent, &ref_sent, sizeof(sent)))
+            bad_count++;
+        // Same check when new data is supplied
+        random_msg(&msg2);
+        memcpy(msg.data, msg2.data, sizeof(msg.data));
+        ret = queue_and_send(&msg, NULL, NULL, ref_queue, &ref_sent);
+        ret |= queue_and_send(&msg, &pm, msg.data, queue, &sent);
+        if (ret || memcmp(queue, ref_queue, sizeof(queue))
+            || memcmp(&sent, &ref_sent, sizeof(sent)))
+            bad_count++;
+    }
+    int bad = bad_count || error_count;
+    printf("tx prepared: msgs=%u mismatch=%u errors=%u %s\n"
+           , PREPARED_MSGS, bad_count, error_count, bad ? "FAIL" : "ok");
+    return bad;
+}
+
+#define BATCH_PREFILL 10
+#define BATCH_SIZE 10
+
+static void
+fill_batch_msg(struct can2040_msg *msg, uint32_t seq)
+{
+    memset(msg, 0, sizeof(*msg));
+    msg->id = 0x100 + seq;
+    msg->dlc = 8;
+    msg->data32[0] = seq;
+    msg->data32[1] = ~seq;
+}
+
+static int
+test_batch(void)
+{
+    memset(tx_queue, 0, sizeof(tx_queue));
+    can2040_setup(&cd, 0);
+    can2040_callback_config(&cd, tx_cb);
+    can2040_tx_queue_config(&cd, tx_queue, QUEUE_SIZE);
+    hostsim_start(&cd);
+
+    // Queue fills in the middle of a batch - only the first part is sent
+    struct can2040_msg msgs[BATCH_PREFILL + BATCH_SIZE], msg;
+    uint32_t i;
+    for (i=0; i<ARRAY_SIZE(msgs); i++)
+        fill_batch_msg(&msgs[i], i);
+    int bad = can2040_transmit_batch(&cd, msgs, 0) != 0;
+    for (i=0; i<BATCH_PREFILL; i++)
+        bad |= can2040_transmit(&cd, &msgs[i]) != 0;
+    int first = can2040_transmit_batch(&cd, &msgs[BATCH_PREFILL]
+                                       , BATCH_SIZE);
+    bad |= first != QUEUE_SIZE - BATCH_PREFILL;
+    bad |= can2040_check_transmit(&cd) != 0;
+    bad |= can2040_transmit_batch(&cd, &msgs[BATCH_PREFILL + first], 1) != 0;
+
+    // Drain a few messages and send the rest of the batch
+    uint32_t sent = 0;
+    for (i=0; i<4; i++, sent++)
+        bad |= (hostsim_tx_bus_next(&cd, &msg)
+                || memcmp(&msg, &msgs[sent], sizeof(msg)));
+    uint32_t rest = BATCH_SIZE - first;
+    int second = can2040_transmit_batch(&cd, &msgs[BATCH_PREFILL + first]
+                                        , rest);
+    bad |= second != rest;
+
+    // All messages are sent in order (and each is reported)
+    while (!hostsim_tx_bus_next(&cd, &msg)) {
+        if (sent >= ARRAY_SIZE(msgs)
+            || memcmp(&msg, &msgs[sent], sizeof(msg)))
+            bad = 1;
+        sent++;
+    }
+    struct can2040_stats stats;
+    can2040_get_statistics(&cd, &stats);
+    bad |= (sent != ARRAY_SIZE(msgs) || stats.tx_total != sent
+            || error_count);
+    printf("tx batch: first=%d second=%d sent=%u tx_total=%u %s\n"
+           , first, second, sent, stats.tx_total, bad ? "FAIL" : "ok");
+    return bad;
+}
+
+#define LARGE_LIMIT 65536
+
+// Queue entries beyond the limit must not be used
+static int
+test_large_queue(void)
+{
+    static struct can2040_transmit large_queue[LARGE_LIMIT * 2];
+    memset(large_queue, 0xa5, sizeof(large_queue));
+    can2040_setup(&cd, 0);
+    can2040_callback_config(&cd, tx_cb);
+    can2040_tx_queue_config(&cd, large_queue, ARRAY_SIZE(large_queue));
+    hostsim_start(&cd);
+
+    struct can2040_msg msg;
+    uint32_t queued = 0, sent = 0, order = 0;
+    for (;;) {
+        fill_batch_msg(&msg, queued);
+        if (can2040_transmit(&cd, &msg))
+            break;
+        queued++;
+    }
+    while (!hostsim_tx_bus_next(&cd, &msg)) {
+        if (msg.data32[0] != sent || msg.data32[1] != ~sent)
+            order++;
+        sent++;
+    }
+    uint8_t unused[sizeof(large_queue[0])];
+    memset(unused, 0xa5, sizeof(unused));
+    int touched = memcmp(&large_queue[LARGE_LIMIT], unused, sizeof(unused));
+    int bad = (queued != LARGE_LIMIT || sent != queued || order || touched
+               || error_count);
+    printf("tx queue limit: queued=%u sent=%u order=%u %s\n"
+           , queued, sent, order, bad ? "FAIL" : "ok");
+    return bad;
+}
+
+int
+main(int argc, char **argv)
+{
+    int bad = test_priority();
+    bad |= test_prepared();
+    bad |= test_batch();
+    bad |= test_large_queue();
+    return bad;
+}